@@ -7,6 +7,21 @@
 
 #include "ks.h"
 
+/* start a new byte range, covering the whole document until told otherwise */
+static struct byterange *cli_range(struct config *cfg)
+{
+	struct byterange **r;
+
+	for (r = &cfg->ranges; *r != NULL; r = &(*r)->next)
+		;
+	*r = ks_byterange();
+	(*r)->next = NULL;
+	(*r)->offset = 0;
+	(*r)->length = -1;
+
+	return *r;
+}
+
 %%{
 	machine cli;
 
@@ -16,6 +31,10 @@
 		cfg->cmd = CMD_ADD;
 	}
 
+	action batch {
+		cfg->batch = atoi(arg);
+	}
+
 	action cat {
 		cfg->cmd = CMD_CAT;
 	}
@@ -28,6 +47,14 @@
 		cfg->category = arg + 1;
 	}
 
+	action complete {
+		cfg->cmd = CMD_COMPLETE;
+	}
+
+	action compress {
+		cfg->compress = atoi(arg);
+	}
+
 	action database {
 		cfg->database = arg;
 	}
@@ -40,18 +67,70 @@
 		cfg->file = arg;
 	}
 
+	action format {
+		const char *name = arg + strlen("--format=");
+
+		if (!strcmp(name, "jsonl"))
+			cfg->format = FORMAT_JSONL;
+		else if (!strcmp(name, "nul"))
+			cfg->format = FORMAT_NUL;
+		else if (!strcmp(name, "tsv"))
+			cfg->format = FORMAT_TSV;
+		else
+			cfg->format = FORMAT_TABLE;
+	}
+
+	action framed {
+		cfg->framed = 1;
+	}
+
+	action gc {
+		cfg->cmd = CMD_GC;
+	}
+
 	action help {
 		cfg->cmd = CMD_HELP;
 	}
 
 	action id {
-		cfg->id = atoi(arg);
+		struct idrange **r;
+		char *end;
+
+		for (r = &cfg->ids; *r != NULL; r = &(*r)->next)
+			;
+		*r = ks_idrange();
+		(*r)->next = NULL;
+		(*r)->first = strtoll(arg, &end, 10);
+		(*r)->last = (*end == '-') ? strtoll(end + 1, NULL, 10)
+			: (*r)->first;
+	}
+
+	action import {
+		cfg->cmd = CMD_IMPORT;
 	}
 
 	action init {
 		cfg->cmd = CMD_INIT;
 	}
 
+	action jobs {
+		cfg->jobs = atoi(arg);
+	}
+
+	action length {
+		struct byterange *r;
+
+		for (r = cfg->ranges; r != NULL && r->next != NULL; r = r->next)
+			;
+		if (r == NULL || r->length >= 0)
+			r = cli_range(cfg);
+		r->length = strtoll(arg, NULL, 10);
+	}
+
+	action migrate {
+		cfg->cmd = CMD_MIGRATE;
+	}
+
 	action mod {
 		cfg->cmd = CMD_MOD;
 	}
@@ -60,20 +139,59 @@
 		cfg->noheader = 1;
 	}
 
+	action nottag {
+		struct tag *t;
+
+		t = ks_tag();
+		t->next = cfg->tags;
+		t->label = arg + 1;
+		t->exclude = 1;
+		cfg->tags = t;
+	}
+
+	action nul {
+		cfg->nul = 1;
+	}
+
+	action offset {
+		cli_range(cfg)->offset = strtoll(arg, NULL, 10);
+	}
+
+	action packs {
+		cfg->packs = 1;
+	}
+
+	action query {
+		cfg->query = arg;
+	}
+
 	action rm {
 		cfg->cmd = CMD_RM;
 	}
 
+	action search {
+		cfg->cmd = CMD_SEARCH;
+	}
+
+	action serve {
+		cfg->cmd = CMD_SERVE;
+	}
+
 	action show {
 		cfg->cmd = CMD_SHOW;
 	}
 
+	action stats {
+		cfg->stats = 1;
+	}
+
 	action tag {
 		struct tag *t;
 
 		t = ks_tag();
 		t->next = cfg->tags;
 		t->label = arg + 1;
+		t->exclude = 0;
 		cfg->tags = t;
 	}
 
@@ -85,18 +203,36 @@
 		cfg->title = arg;
 	}
 
+	action trace {
+		cfg->trace = 1;
+	}
+
 	action version {
 		cfg->cmd = CMD_VERSION;
 	}
 
 	global_option =
-		( ("--database\0" | "-d\0") [^\0]+ %database '\0' );
+		  ( ("--database\0" | "-d\0") [^\0]+ %database '\0' )
+		| ( "--stats" %stats '\0' )
+		| ( "--trace" %trace '\0' );
 
 	category = ( '@' [^\0]* %category '\0' );
 
+	compress = ( ("--compress\0" | "-z\0") [0-9] %compress '\0' );
+
 	file = ( ("--file\0" | "-f\0") [^\0]+ %file '\0' );
 
-	id = ( [0-9]+ %id '\0' );
+	format = ( "--format=" ( "jsonl" | "nul" | "table" | "tsv" ) %format '\0' );
+
+	id = ( [0-9]+ ( '-' [0-9]+ )? %id '\0' );
+
+	noheader = ( ("--no-header" | "-n") %noheader '\0' );
+
+	nottag = ( '!' [^\0]+ %nottag '\0' );
+
+	nul = ( ("--null" | "-0") %nul '\0' );
+
+	query = ( ( [^\-@+!\0] [^\0]* ) %query '\0' );
 
 	tag = ( '+' [^\0]+ %tag '\0' );
 
@@ -104,14 +240,31 @@
 
 	add_option =
 		  category
+		| compress
 		| file
 		| tag
 		| title;
 
-	cat_option = id;
+	cat_option =
+		  ( ("--framed" | "-F") %framed '\0' )
+		| id
+		| ( ("--length\0" | "-l\0") [0-9]+ %length '\0' )
+		| ( ("--offset\0" | "-o\0") '-'? [0-9]+ %offset '\0' );
+
+	complete_option = nul;
+
+	import_option =
+		  ( ("--batch\0" | "-b\0") [0-9]+ %batch '\0' )
+		| compress
+		| file
+		| ( ("--jobs\0" | "-j\0") [0-9]+ %jobs '\0' )
+		| nul;
+
+	init_option = ( "--packs" %packs '\0' );
 
 	mod_option =
 		  category
+		| compress
 		| file
 		| id
 		| tag
@@ -119,10 +272,19 @@
 
 	rm_option = id;
 
+	search_option =
+		  category
+		| format
+		| noheader
+		| nottag
+		| tag;
+
 	show_option =
 		  category
+		| format
 		| id
-		| ( ("--no-header" | "-n") %noheader '\0' )
+		| noheader
+		| nottag
 		| tag;
 
 	version_option =
@@ -132,10 +294,17 @@
 		  ( "add" %add '\0' ( add_option | global_option )* )
 		| ( "cat" %cat '\0' ( cat_option | global_option )* )
 		| ( "categories" %categories '\0' ( global_option )* )
+		| ( "complete" %complete '\0' ( complete_option | global_option )* )
+		| ( "gc" %gc '\0' ( global_option )* )
 		| ( "help" %help '\0' )
-		| ( "init" %init '\0' ( global_option )* )
+		| ( "import" %import '\0' ( import_option | global_option )* )
+		| ( "init" %init '\0' ( init_option | global_option )* )
+		| ( "migrate" %migrate '\0' ( global_option )* )
 		| ( ("mod" | "modify") %mod '\0' ( mod_option | global_option )* )
 		| ( "rm" %rm '\0' ( rm_option | global_option )* )
+		| ( "search" %search '\0' ( search_option | global_option )*
+			query ( search_option | global_option )* )
+		| ( "serve" %serve '\0' ( global_option )* )
 		| ( "show" %show '\0' ( show_option | global_option )* )
 		| ( "tags" %tags '\0' ( global_option )* )
 		| ( "version" %version '\0' ( version_option | global_option )* );
@@ -143,7 +312,7 @@
 	main := ( global_option )* command;
 }%%
 
-void cli_parse(int argc, const char *argv[], struct config *cfg)
+int cli_parse(int argc, const char *argv[], struct config *cfg)
 {
 	const char *arg;
 	const char *p;
@@ -160,7 +329,11 @@ void cli_parse(int argc, const char *argv[], struct config *cfg)
 
 		%% write exec;
 
-		if (cs == %%{ write error; }%%)
-			errx(EXIT_FAILURE, "failed parsing argument: %s", arg);
+		if (cs == %%{ write error; }%%) {
+			warnx("failed parsing argument: %s", arg);
+			return -1;
+		}
 	}
+
+	return 0;
 }
@@ -1,21 +1,71 @@
-#include <assert.h>
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
+#include <zlib.h>
 
 #include "ks.h"
+#include "sha256.h"
 
 #define VERSION_MAJOR	0
 #define VERSION_MINOR	1
 #define VERSION_PATCH	0
 
+#define DB_VERSION	8
+
 #define _MAKESTR(s) #s
 #define MAKESTR(s) _MAKESTR(s)
 
-#define IOSIZE 4096
+/* documents are stored as a sequence of blobs of (at most) this many bytes */
+#define CHUNKSIZE 1048576
+
+#define MMAPSIZE 268435456
+
+#define NAMEBUCKETS 1024
+
+/* prepared statements kept for reuse, least recently used dropped first */
+#define STMTCACHE 64
+
+/* a payload's first chunks, up to this many, are compressed before storing */
+#define PACKAHEAD 4
+
+/* only this many leading chunks of a document's text are indexed for search */
+#define TEXTCHUNKS 16
+
+/* new data goes to a new pack file once the current one is this large */
+#define PACKSIZE 4294967296LL
+
+/* gc rewrites a pack once at least 1/PACKDEAD of it is no longer used */
+#define PACKDEAD 4
+
+/*
+ * Where errors unwind to while serving a request, instead of exiting, and the
+ * status to report to the client: an exit status, or a negated signal number.
+ */
+static jmp_buf *ks_onerr;
+static int ks_status;
 
 static void ks_err(const char *fmt, ...)
 {
@@ -31,6 +81,10 @@ static void ks_err(const char *fmt, ...)
 
 	fprintf(stderr, ": %s\n", errstr);
 
+	if (ks_onerr != NULL) {
+		ks_status = EXIT_FAILURE;
+		longjmp(*ks_onerr, 1);
+	}
 	exit(EXIT_FAILURE);
 }
 
@@ -46,12 +100,39 @@ static void ks_errx(const char *fmt, ...)
 
 	fprintf(stderr, "\n");
 
+	if (ks_onerr != NULL) {
+		ks_status = EXIT_FAILURE;
+		longjmp(*ks_onerr, 1);
+	}
 	exit(EXIT_FAILURE);
 }
 
-struct dynstr {
-	struct dynstr *next;
-	char data[];
+/*
+ * Memory is bump-allocated from arenas of large blocks and released all at
+ * once: m.cache lives until exit, and m.arena until the command is done (which
+ * for a server means each request).
+ */
+#define BLOCKSIZE 65536
+
+union align {
+	long double ld;
+	long long ll;
+	void *p;
+	void (*fp)(void);
+};
+
+#define ALIGN(n) \
+	(((n) + sizeof(union align) - 1) & ~(sizeof(union align) - 1))
+
+struct block {
+	struct block *next;
+	size_t used;
+	size_t size;
+	union align data[];
+};
+
+struct arena {
+	struct block *blocks;
 };
 
 struct stmt {
@@ -60,61 +141,145 @@ struct stmt {
 };
 
 struct row {
-	struct row *next;
-	struct row *mnext;
 	const char *title;
 	const char *category;
-	struct tag *tags;
+	const char *tags;
+	sqlite3_int64 id;
+};
+
+/* category and tag ids that have already been looked up, by name */
+struct name {
+	struct name *next;
+	const char *name;
 	sqlite3_int64 id;
 };
 
+struct names {
+	struct name *buckets[NAMEBUCKETS];
+};
+
 struct mem {
 	struct sqlite3 *db;
-	struct dynstr *s;
+	struct arena cache;
+	struct arena arena;
 	struct stmt *stmts;
-	struct tag *tags;
-	struct row *rows;
+	int nstmts;
+	sqlite3_blob *blob;
+	struct payload *payload;
+	char *text;
+	struct packfile *packs;
+	const char *path;
+	struct names cids;
+	struct names tids;
 };
 
 static struct mem m;
 
-static struct row *ks_row()
+/*
+ * With --stats, time spent in each phase of a command and how much work it
+ * did are tallied here and reported on stderr when it finishes. Row callbacks
+ * may run statements of their own, so the phases can overlap.
+ */
+struct stats {
+	double start;
+	double open;
+	double prepare;
+	double step;
+	double rows;
+	sqlite3_int64 prepared;
+	sqlite3_int64 cached;
+	sqlite3_int64 steps;
+	sqlite3_int64 nrows;
+	sqlite3_int64 bytesread;
+	sqlite3_int64 byteswritten;
+	int enabled;
+	int trace;
+};
+
+static struct stats st;
+
+static double ks_clock(void)
 {
-	struct row *r;
+	struct timespec now;
 
-	r = malloc(sizeof(*r));
-	if (r == NULL)
-		ks_err("malloc");
-	r->mnext = m.rows;
-	m.rows = r;
+	if (!st.enabled)
+		return 0;
 
-	return r;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
 }
 
-struct tag *ks_tag(void)
+static void *ks_alloc(struct arena *a, size_t size)
 {
-	struct tag *t;
+	struct block *b = a->blocks;
+	size_t blocksize;
+	char *p;
+
+	size = ALIGN(size);
+	if (b == NULL || b->size - b->used < size) {
+		blocksize = (size > BLOCKSIZE) ? size : BLOCKSIZE;
+		b = malloc(sizeof(*b) + blocksize);
+		if (b == NULL)
+			ks_err("malloc(%lu)", sizeof(*b) + blocksize);
+		b->used = 0;
+		b->size = blocksize;
+
+		/* keep filling the current block after a one-off large one */
+		if (blocksize > BLOCKSIZE && a->blocks != NULL) {
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		} else {
+			b->next = a->blocks;
+			a->blocks = b;
+		}
+	}
 
-	t = malloc(sizeof(*t));
-	if (t == NULL)
-		ks_err("malloc");
-	t->mnext = m.tags;
-	m.tags = t;
+	p = (char *)b->data + b->used;
+	b->used += size;
 
-	return t;
+	return p;
 }
 
-static char *ks_stralloc(size_t len)
+static void ks_reset(struct arena *a)
 {
-	struct dynstr *ds;
+	struct block *b, *n;
 
-	ds = malloc(sizeof(*ds) + len + 1);
-	if (ds == NULL)
-		ks_err("malloc(%lu)", len);
-	ds->next = m.s;
-	m.s = ds;
+	if (a->blocks == NULL)
+		return;
 
-	return ds->data;
+	for (b = a->blocks->next; b != NULL; b = n) {
+		n = b->next;
+		free(b);
+	}
+	a->blocks->next = NULL;
+	a->blocks->used = 0;
+}
+
+static void ks_free(struct arena *a)
+{
+	ks_reset(a);
+	free(a->blocks);
+	a->blocks = NULL;
+}
+
+struct tag *ks_tag(void)
+{
+	return ks_alloc(&m.arena, sizeof(struct tag));
+}
+
+struct idrange *ks_idrange(void)
+{
+	return ks_alloc(&m.arena, sizeof(struct idrange));
+}
+
+struct byterange *ks_byterange(void)
+{
+	return ks_alloc(&m.arena, sizeof(struct byterange));
+}
+
+static char *ks_stralloc(size_t len)
+{
+	return ks_alloc(&m.arena, len + 1);
 }
 
 static char *ks_strdup(const char *s)
@@ -127,55 +292,277 @@ static char *ks_strdup(const char *s)
 	return r;
 }
 
+static char *ks_sprintf(const char *fmt, ...)
+{
+	va_list ap;
+	char *result;
+	size_t len;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (rc < 0)
+		ks_errx("can't format string");
+	len = (size_t)rc;
+
+	result = ks_stralloc(len);
+
+	va_start(ap, fmt);
+	vsnprintf(result, len + 1, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+static struct name **ks_bucket(struct names *n, const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *name != '\0'; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+
+	return &n->buckets[h % NAMEBUCKETS];
+}
+
+static sqlite3_int64 ks_lookupname(struct names *n, const char *name)
+{
+	struct name *e;
+
+	for (e = *ks_bucket(n, name); e != NULL; e = e->next)
+		if (strcmp(e->name, name) == 0)
+			return e->id;
+
+	return -1;
+}
+
+static sqlite3_int64 ks_savename(struct names *n, const char *name,
+		sqlite3_int64 id)
+{
+	struct name **bucket = ks_bucket(n, name);
+	struct name *e;
+
+	e = ks_alloc(&m.arena, sizeof(*e));
+	e->name = ks_strdup(name);
+	e->id = id;
+	e->next = *bucket;
+	*bucket = e;
+
+	return id;
+}
+
+/*
+ * Statements are cached by their SQL text: each distinct query is prepared
+ * once, then reset and reused on every later call until ks_cleanup finalizes
+ * it. Callers must therefore not re-enter the same query from a row callback.
+ */
+/*
+ * Statements are cached by their SQL, most recently used first. Show and
+ * search build theirs from the command line, so the cache is capped, and a
+ * statement that is still being stepped (by a caller further up) is never the
+ * one dropped.
+ */
 static sqlite3_stmt *ks_prepare(const char *sql)
 {
+	struct stmt **prev;
+	struct stmt **victim = NULL;
 	struct stmt *stmt;
+	sqlite3_stmt *prepared;
+	double start;
 	int rc;
 
-	stmt = malloc(sizeof(*stmt));
-	if (stmt == NULL)
-		ks_err("malloc");
-
-	stmt->next = m.stmts;
-	m.stmts = stmt;
-	stmt->stmt = NULL;
+	for (prev = &m.stmts; (stmt = *prev) != NULL; prev = &stmt->next) {
+		if (strcmp(sqlite3_sql(stmt->stmt), sql) == 0) {
+			*prev = stmt->next;
+			stmt->next = m.stmts;
+			m.stmts = stmt;
+			sqlite3_reset(stmt->stmt);
+			sqlite3_clear_bindings(stmt->stmt);
+			st.cached++;
+			return stmt->stmt;
+		}
+		if (!sqlite3_stmt_busy(stmt->stmt))
+			victim = prev;
+	}
 
-	rc = sqlite3_prepare_v2(m.db, sql, -1, &stmt->stmt, NULL);
+	start = ks_clock();
+	rc = sqlite3_prepare_v2(m.db, sql, -1, &prepared, NULL);
 	if (rc != SQLITE_OK)
 		ks_errx("can't prepare statement: %s",
 				sqlite3_errmsg(m.db));
+	st.prepare += ks_clock() - start;
+	st.prepared++;
+
+	if (m.nstmts >= STMTCACHE && victim != NULL) {
+		stmt = *victim;
+		*victim = stmt->next;
+		sqlite3_finalize(stmt->stmt);
+	} else {
+		stmt = ks_alloc(&m.cache, sizeof(*stmt));
+		m.nstmts++;
+	}
+
+	stmt->stmt = prepared;
+	stmt->next = m.stmts;
+	m.stmts = stmt;
 
 	return stmt->stmt;
 }
 
-static sqlite3 *ks_open(const char *path)
+/*
+ * Connection settings applied to every database on open, each of which may be
+ * overridden by the environment variable beside it. In WAL mode readers never
+ * wait for a writer (nor it for them), and a commit only needs a full sync at
+ * checkpoints; the mapping lets reads come straight from the page cache.
+ */
+static const struct pragma {
+	const char *name;
+	const char *env;
+	const char *value;
+} ks_pragmas[] = {
+	{ "journal_mode", "KS_JOURNAL_MODE", "WAL" },
+	{ "synchronous", "KS_SYNCHRONOUS", "NORMAL" },
+	{ "mmap_size", "KS_MMAP_SIZE", MAKESTR(MMAPSIZE) },
+	{ "cache_size", "KS_CACHE_SIZE", "-65536" },
+	{ "temp_store", "KS_TEMP_STORE", "MEMORY" },
+	{ "busy_timeout", "KS_BUSY_TIMEOUT", "5000" },
+};
+
+static void ks_tune(sqlite3 *db)
+{
+	const char *value;
+	size_t i;
+
+	for (i = 0; i < sizeof(ks_pragmas) / sizeof(ks_pragmas[0]); i++) {
+		value = getenv(ks_pragmas[i].env);
+		if (value == NULL || *value == '\0')
+			value = ks_pragmas[i].value;
+		else if (value[strspn(value, "-0123456789ABCDEFGHIJKLMNOPQRSTU"
+					"VWXYZabcdefghijklmnopqrstuvwxyz")]
+				!= '\0')
+			ks_errx("invalid %s: %s", ks_pragmas[i].env, value);
+
+		/* like any other pragma, these are only hints */
+		(void)sqlite3_exec(db, ks_sprintf("PRAGMA %s = %s;",
+					ks_pragmas[i].name, value),
+				NULL, NULL, NULL);
+	}
+}
+
+/* with --trace, every statement is printed as it finishes */
+static int ks_trace(unsigned type, void *arg, void *p, void *x)
+{
+	sqlite3_stmt *stmt = p;
+	char *sql;
+
+	(void)type;
+	(void)arg;
+
+	sql = sqlite3_expanded_sql(stmt);
+	fprintf(stderr, "trace: %10.3f ms %8d steps  %s\n",
+			(double)*(sqlite3_int64 *)x / 1e6,
+			sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1),
+			(sql != NULL) ? sql : sqlite3_sql(stmt));
+	sqlite3_free(sql);
+
+	return 0;
+}
+
+static void ks_settrace(sqlite3 *db)
+{
+	(void)sqlite3_trace_v2(db, st.trace ? SQLITE_TRACE_PROFILE : 0,
+			ks_trace, NULL);
+}
+
+/* this can't change inside a transaction, so it's set between them */
+static void ks_foreignkeys(sqlite3 *db, int on)
+{
+	int rc;
+
+	rc = sqlite3_exec(db, on ? "PRAGMA foreign_keys = ON;"
+			: "PRAGMA foreign_keys = OFF;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK)
+		ks_errx("can't set foreign keys: %s", sqlite3_errmsg(db));
+}
+
+/* packs are named after the database, which a server must find from any cwd */
+static void ks_setpath(const char *path)
+{
+	char cwd[PATH_MAX];
+	char *p;
+
+	if (path[0] == '/') {
+		p = ks_alloc(&m.cache, strlen(path) + 1);
+		strcpy(p, path);
+	} else {
+		if (getcwd(cwd, sizeof(cwd)) == NULL)
+			ks_err("getcwd");
+		p = ks_alloc(&m.cache, strlen(cwd) + strlen(path) + 2);
+		sprintf(p, "%s/%s", cwd, path);
+	}
+
+	m.path = p;
+}
+
+static sqlite3 *ks_opendb(const char *path)
 {
 	sqlite3 *db;
+	double start;
 	int rc;
 
+	/* a server keeps its connection open across requests */
+	if (m.db != NULL)
+		return m.db;
+
+	start = ks_clock();
 	rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL);
 	m.db = db;
 	if (rc != SQLITE_OK)
 		ks_errx("can't open %s: %s", path,
 				sqlite3_errmsg(db));
 
+	ks_setpath(path);
+	ks_settrace(db);
+	ks_tune(db);
+	ks_foreignkeys(db, 1);
+	st.open += ks_clock() - start;
+
 	return db;
 }
 
+/*
+ * Writers take the write lock up front, so they queue on the busy timeout
+ * rather than failing when they upgrade from reading part-way through.
+ */
 static void ks_begin(sqlite3 *db)
 {
 	int rc;
 
-	rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+	rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK)
+		ks_errx("failed to begin transaction: %s",
+				sqlite3_errmsg(db));
+}
+
+static void ks_beginread(sqlite3 *db)
+{
+	int rc;
+
+	rc = sqlite3_exec(db, "BEGIN DEFERRED;", NULL, NULL, NULL);
 	if (rc != SQLITE_OK)
 		ks_errx("failed to begin transaction: %s",
 				sqlite3_errmsg(db));
 }
 
+static void ks_syncpacks(void);
+
 static void ks_end(sqlite3 *db)
 {
 	int rc;
 
+	/* data in packs must be durable before anything that refers to it */
+	ks_syncpacks();
+
 	rc = sqlite3_exec(db, "END;", NULL, NULL, NULL);
 	if (rc != SQLITE_OK)
 		ks_errx("failed to commit transaction: %s",
@@ -193,7 +580,10 @@ struct binding {
 	union {
 		sqlite3_int64 integer;
 		const char *text;
-		int bloblen;
+		struct {
+			const void *data;
+			sqlite3_uint64 len;
+		} blob;
 	} value;
 	enum binding_t type;
 };
@@ -218,7 +608,8 @@ static void ks_bind(sqlite3 *db, sqlite3_stmt *stmt, struct binding *bindings,
 					SQLITE_STATIC);
 			break;
 		case BINDING_BLOB:
-			rc = sqlite3_bind_zeroblob(stmt, i, b->value.bloblen);
+			rc = sqlite3_bind_blob64(stmt, i, b->value.blob.data,
+					b->value.blob.len, SQLITE_STATIC);
 			break;
 		default:
 			ks_errx("invalid binding type: %d", b->type);
@@ -234,11 +625,22 @@ static void ks_bind(sqlite3 *db, sqlite3_stmt *stmt, struct binding *bindings,
 static void ks_run(sqlite3 *db, sqlite3_stmt *stmt,
 		void (*cb)(sqlite3 *, sqlite3_stmt *, void *), void *arg)
 {
+	double start;
 	int rc;
 
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	for (;;) {
+		start = ks_clock();
+		rc = sqlite3_step(stmt);
+		st.step += ks_clock() - start;
+		st.steps++;
+		if (rc != SQLITE_ROW)
+			break;
+
+		st.nrows++;
+		start = ks_clock();
 		if (cb != NULL)
 			cb(db, stmt, arg);
+		st.rows += ks_clock() - start;
 	}
 
 	if (rc != SQLITE_DONE)
@@ -268,6 +670,33 @@ static void ks_storeint(sqlite3 *db, sqlite3_stmt *stmt, void *_n)
 	*n = sqlite3_column_int64(stmt, 0);
 }
 
+static sqlite3_int64 ks_getversion(sqlite3 *db)
+{
+	const char *sql = "SELECT v FROM version;";
+	sqlite3_int64 v = -1;
+
+	ks_sql(db, sql, NULL, 0, ks_storeint, &v);
+	return v;
+}
+
+static sqlite3 *ks_open(const char *path)
+{
+	sqlite3 *db;
+	sqlite3_int64 v;
+
+	db = ks_opendb(path);
+
+	v = ks_getversion(db);
+	if (v < DB_VERSION)
+		ks_errx("%s uses database version %lld; run 'ks migrate'",
+				path, v);
+	else if (v > DB_VERSION)
+		ks_errx("%s uses database version %lld; this ks supports "
+				"up to version %d", path, v, DB_VERSION);
+
+	return db;
+}
+
 static sqlite3_int64 ks_getcid(sqlite3 *db, const char *category)
 {
 	struct binding b = {
@@ -298,193 +727,1765 @@ static sqlite3_int64 ks_cid(sqlite3 *db, const char *category)
 {
 	sqlite3_int64 cid;
 
-	cid = ks_getcid(db, category);
+	cid = ks_lookupname(&m.cids, category);
 	if (cid >= 0)
 		return cid;
 
-	return ks_create_category(db, category);
+	cid = ks_getcid(db, category);
+	if (cid < 0)
+		cid = ks_create_category(db, category);
+
+	return ks_savename(&m.cids, category, cid);
 }
 
-static FILE *ks_openfile(const char *filename, int *datalen)
+static size_t ks_readfull(int fd, char *buf, size_t len)
 {
-	FILE *fp;
-	int rc;
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < len) {
+		n = read(fd, buf + total, len - total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			ks_err("read");
+		else if (n == 0)
+			break;
+		total += (size_t)n;
+	}
 
-	if (filename == NULL) {
-		*datalen = 0;
-		return NULL;
+	return total;
+}
+
+static void ks_writefull(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EPIPE && ks_onerr != NULL) {
+			/* the client's reader went away, as if by SIGPIPE */
+			ks_status = -SIGPIPE;
+			longjmp(*ks_onerr, 1);
+		} else if (n < 0) {
+			ks_err("write");
+		}
+		buf += n;
+		len -= (size_t)n;
 	}
+}
 
-	fp = fopen(filename, "r");
-	if (fp == NULL)
-		ks_err("fopen(%s)", filename);
+/*
+ * Libraries created with 'ks init --packs' keep new document data out of the
+ * database, appended to pack files beside it named "<database>.<n>.pack". The
+ * blobs table records where in which pack each blob is, and the packs table
+ * how much of each pack is committed and how much of that is dead. Bytes past
+ * a pack's committed size belong to no blob: they are left by transactions
+ * that rolled back, or by data that turned out to be a duplicate, and are
+ * overwritten by the next append.
+ */
+struct location {
+	sqlite3_int64 pack;
+	sqlite3_int64 offset;
+	sqlite3_int64 length;
+};
 
-	rc = fseek(fp, 0, SEEK_END);
-	if (rc < 0)
-		ks_err("fseek(SEEK_END)");
+struct packfile {
+	struct packfile *next;
+	sqlite3_int64 pack;
+	int fd;
+	int writable;
+	int created;
+	int dirty;
+};
 
-	*datalen = ftell(fp);
-	if (*datalen < 0)
-		ks_err("ftell");
+static const char *ks_packpath(sqlite3_int64 pack)
+{
+	return ks_sprintf("%s.%lld.pack", m.path, pack);
+}
 
-	rewind(fp);
+/* the directory the database, and so its packs, are in */
+static const char *ks_packdir(void)
+{
+	const char *slash = strrchr(m.path, '/');
 
-	return fp;
+	if (slash == m.path)
+		return "/";
+	return ks_sprintf("%.*s", (int)(slash - m.path), m.path);
 }
 
-static void ks_writeblob(sqlite3 *db, sqlite3_int64 rowid, FILE *fp)
+/*
+ * Packs are only created by writers, which hold the write lock. Readers open
+ * them read-only, so a pack that is missing (say, compacted away by gc) fails
+ * to open rather than coming back empty.
+ */
+static struct packfile *ks_packfile(sqlite3_int64 pack, int write)
 {
-	char buf[IOSIZE];
-	sqlite3_blob *blob;
-	size_t nbytes;
-	int rc;
-	int offset;
+	struct packfile *pf;
 
-	rc = sqlite3_blob_open(db, "main", "documents", "data", rowid,
-			1, &blob);
-	if (rc != SQLITE_OK)
-		ks_errx("blob_open: %s", sqlite3_errmsg(db));
+	for (pf = m.packs; pf != NULL; pf = pf->next)
+		if (pf->pack == pack)
+			break;
 
-	offset = 0;
-	do {
-		nbytes = fread(buf, 1, sizeof(buf), fp);
-		assert(nbytes <= sizeof(buf));
-		rc = sqlite3_blob_write(blob, buf, (int)nbytes, offset);
-		if (rc != SQLITE_OK)
-			ks_errx("blob_write: %s", sqlite3_errmsg(db));
+	if (pf == NULL) {
+		pf = ks_alloc(&m.cache, sizeof(*pf));
+		pf->pack = pack;
+		pf->fd = -1;
+		pf->writable = 0;
+		pf->created = 0;
+		pf->dirty = 0;
+		pf->next = m.packs;
+		m.packs = pf;
+	}
 
-		offset += nbytes;
-	} while (nbytes == sizeof(buf));
+	if (pf->fd >= 0 && write && !pf->writable) {
+		close(pf->fd);
+		pf->fd = -1;
+	}
 
-	sqlite3_blob_close(blob);
+	if (pf->fd >= 0)
+		return pf;
+
+	if (write) {
+		pf->fd = open(ks_packpath(pack), O_RDWR | O_CREAT | O_EXCL,
+				0666);
+		if (pf->fd >= 0)
+			pf->created = 1;
+		else if (errno == EEXIST)
+			pf->fd = open(ks_packpath(pack), O_RDWR);
+	} else {
+		pf->fd = open(ks_packpath(pack), O_RDONLY);
+	}
 
-	if (ferror(fp))
-		ks_errx("fread");
-	fclose(fp);
+	if (pf->fd < 0)
+		ks_err("open(%s)", ks_packpath(pack));
+	pf->writable = write;
+
+	return pf;
 }
 
-static sqlite3_int64 ks_tid(sqlite3 *db, const char *label)
+/*
+ * A new pack's directory entry is synced too, or a crash could keep a commit
+ * that refers to the pack but lose the file itself.
+ */
+static void ks_syncpacks(void)
 {
-	struct binding b = {
-		.type = BINDING_TEXT,
-		.value = {.text = label},
-	};
-	const char *sql = "SELECT (tid) FROM tags WHERE label = ?;";
-	const char *insql = "INSERT INTO tags (label) VALUES (?);";
-	sqlite3_int64 tid = -1;
+	struct packfile *pf;
+	int created = 0;
+	int err;
+	int fd;
+	int rc;
 
-	ks_sql(db, sql, &b, 1, ks_storeint, &tid);
+	for (pf = m.packs; pf != NULL; pf = pf->next) {
+		if (pf->dirty && fdatasync(pf->fd) < 0)
+			ks_err("fdatasync(%s)", ks_packpath(pf->pack));
+		created |= pf->created;
+		pf->dirty = 0;
+		pf->created = 0;
+	}
 
-	if (tid >= 0)
-		return tid;
+	if (!created)
+		return;
+
+	fd = open(ks_packdir(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		ks_err("open(%s)", ks_packdir());
+	rc = fsync(fd);
+	err = errno;
+	close(fd);
+	if (rc < 0) {
+		errno = err;
+		ks_err("fsync(%s)", ks_packdir());
+	}
+}
 
-	ks_sql(db, insql, &b, 1, NULL, NULL);
+static void ks_closepacks(void)
+{
+	struct packfile *pf;
+
+	for (pf = m.packs; pf != NULL; pf = pf->next) {
+		if (pf->fd >= 0)
+			close(pf->fd);
+		pf->fd = -1;
+		pf->created = 0;
+		pf->dirty = 0;
+	}
+}
 
-	return sqlite3_last_insert_rowid(db);
+static void ks_packwrite(struct packfile *pf, const char *buf, size_t len,
+		sqlite3_int64 off)
+{
+	ssize_t n;
+
+	pf->dirty = 1;
+	st.byteswritten += (sqlite3_int64)len;
+	while (len > 0) {
+		n = pwrite(pf->fd, buf, len, (off_t)off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			ks_err("write(%s)", ks_packpath(pf->pack));
+		buf += n;
+		len -= (size_t)n;
+		off += n;
+	}
 }
 
-static void ks_inserttag(sqlite3 *db, sqlite3_int64 id, const char *label)
+static void ks_packread(struct packfile *pf, char *buf, size_t len,
+		sqlite3_int64 off)
 {
-	struct binding b[] = {
-		{
-			.type = BINDING_INTEGER,
-			.value = {.integer = id},
-		}, {
-			.type = BINDING_INTEGER,
-			.value = {.integer = -1},
-		}
-	};
-	const char *sql = "INSERT INTO doctag (id, tid) VALUES (?, ?);";
-	b[1].value.integer = ks_tid(db, label);
-	ks_sql(db, sql, b, 2, NULL, NULL);
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(pf->fd, buf, len, (off_t)off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			ks_err("read(%s)", ks_packpath(pf->pack));
+		else if (n == 0)
+			ks_errx("%s is truncated", ks_packpath(pf->pack));
+		buf += n;
+		len -= (size_t)n;
+		off += n;
+		st.bytesread += n;
+	}
 }
 
-static void ks_add(const struct config *cfg)
+/* hand [start, end) of a blob in a pack to fn, a chunk's worth at a time */
+static void ks_readpack(const struct location *loc, sqlite3_int64 start,
+		sqlite3_int64 end, void (*fn)(const void *, size_t, void *),
+		void *arg)
+{
+	static char *buf;
+	struct packfile *pf;
+	size_t len;
+
+	if (buf == NULL)
+		buf = ks_alloc(&m.cache, CHUNKSIZE);
+
+	pf = ks_packfile(loc->pack, 0);
+	for (; start < end; start += (sqlite3_int64)len) {
+		len = (end - start < CHUNKSIZE) ? (size_t)(end - start)
+			: CHUNKSIZE;
+		ks_packread(pf, buf, len, loc->offset + start);
+		fn(buf, len, arg);
+	}
+}
+
+static void ks_insertchunk(sqlite3 *db, sqlite3_int64 bid, sqlite3_int64 seq,
+		const void *data, size_t len)
 {
 	struct binding b[] = {
 		{
-			.type = BINDING_TEXT,
-			.value = {.text = cfg->title},
+			.type = BINDING_INTEGER,
+			.value = {.integer = bid},
 		}, {
 			.type = BINDING_INTEGER,
-			.value = {.integer = -1},
+			.value = {.integer = seq},
 		}, {
 			.type = BINDING_BLOB,
-			.value = {.bloblen = 0},
+			.value = {.blob = {data, len}},
 		}
 	};
 	const char *sql =
-		"INSERT INTO documents (title, cid, data) VALUES (?, ?, ?);";
-	sqlite3 *db;
-	struct tag *t;
-	FILE *fp;
-	int datalen;
-	sqlite3_int64 id;
-
-	if (cfg->title == NULL)
-		ks_errx("title is required when adding a document");
-
-	db = ks_open(cfg->database);
-	ks_begin(db);
-
-	if (cfg->category == NULL)
-		b[1].value.integer = ks_cid(db, "");
-	else
-		b[1].value.integer = ks_cid(db, cfg->category);
-
-	fp = ks_openfile(cfg->file, &datalen);
-	if (datalen == 0)
-		b[2].type = BINDING_NULL;
-	else
-		b[2].value.bloblen = datalen;
+		"INSERT INTO chunks (bid, seq, data) VALUES (?, ?, ?);";
 
 	ks_sql(db, sql, b, 3, NULL, NULL);
+	st.byteswritten += (sqlite3_int64)len;
+}
 
-	id = sqlite3_last_insert_rowid(db);
-
-	if (fp != NULL)
-		ks_writeblob(db, id, fp);
-
-	for (t = cfg->tags; t != NULL; t = t->next)
-		ks_inserttag(db, id, t->label);
+/*
+ * Document data is stored once per distinct content in the blobs table, keyed
+ * by its SHA-256 hash and reference counted by the documents that use it.
+ */
+static sqlite3_int64 ks_findblob(sqlite3 *db,
+		const unsigned char hash[SHA256_LEN])
+{
+	struct binding b = {
+		.type = BINDING_BLOB,
+		.value = {.blob = {hash, SHA256_LEN}},
+	};
+	const char *sql = "SELECT bid FROM blobs WHERE hash = ?;";
+	sqlite3_int64 bid = -1;
 
-	ks_end(db);
+	ks_sql(db, sql, &b, 1, ks_storeint, &bid);
+	return bid;
 }
 
-static void ks_cat(const struct config *cfg)
+static sqlite3_int64 ks_newblob(sqlite3 *db)
 {
-	char buf[IOSIZE];
-	sqlite3 *db;
-	sqlite3_blob *blob;
-	int rc;
-	int offset;
-	int remaining;
+	const char *sql = "INSERT INTO blobs (hash, refs) VALUES (NULL, 1);";
 
-	if (cfg->id < 0)
-		ks_errx("cat command requires an id");
+	ks_sql(db, sql, NULL, 0, NULL, NULL);
+	return sqlite3_last_insert_rowid(db);
+}
 
-	db = ks_open(cfg->database);
+static void ks_sethash(sqlite3 *db, sqlite3_int64 bid,
+		const unsigned char hash[SHA256_LEN])
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_BLOB,
+			.value = {.blob = {hash, SHA256_LEN}},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = bid},
+		}
+	};
+	const char *sql = "UPDATE blobs SET hash = ? WHERE bid = ?;";
+
+	ks_sql(db, sql, b, 2, NULL, NULL);
+}
+
+static void ks_refblob(sqlite3 *db, sqlite3_int64 bid, int delta)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = delta},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = bid},
+		}
+	};
+	const char *sql = "UPDATE blobs SET refs = refs + ? WHERE bid = ?;";
+	const char *chunksql =
+		"DELETE FROM chunks WHERE bid = ?1 "
+			"AND (SELECT refs FROM blobs WHERE bid = ?1) <= 0;";
+	const char *blobsql = "DELETE FROM blobs WHERE bid = ? AND refs <= 0;";
+
+	ks_sql(db, sql, b, 2, NULL, NULL);
+	ks_sql(db, chunksql, &b[1], 1, NULL, NULL);
+	ks_sql(db, blobsql, &b[1], 1, NULL, NULL);
+}
+
+static void ks_dropblob(sqlite3 *db, sqlite3_int64 bid)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = bid},
+	};
+	const char *sql =
+		"UPDATE packs SET dead = dead + ("
+			"SELECT length FROM blobs WHERE bid = ?1"
+		") WHERE pack = ("
+			"SELECT pack FROM blobs WHERE bid = ?1 AND refs <= 1"
+		");";
+
+	ks_sql(db, sql, &b, 1, NULL, NULL);
+	ks_refblob(db, bid, -1);
+}
+
+static void ks_storelocation(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct location *loc = arg;
+
+	(void)db;
+
+	loc->pack = sqlite3_column_int64(stmt, 0);
+	loc->offset = sqlite3_column_int64(stmt, 1);
+	loc->length = sqlite3_column_int64(stmt, 2);
+}
+
+/* where a blob's data is, if it's in a pack; loc->pack is 0 if it isn't */
+static void ks_getlocation(sqlite3 *db, sqlite3_int64 bid,
+		struct location *loc)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = bid},
+	};
+	const char *sql =
+		"SELECT ifnull(pack, 0), ifnull(offset, 0), ifnull(length, 0) "
+		"FROM blobs WHERE bid = ?;";
+
+	loc->pack = 0;
+	loc->offset = 0;
+	loc->length = 0;
+	ks_sql(db, sql, &b, 1, ks_storelocation, loc);
+}
+
+static void ks_setlocation(sqlite3 *db, sqlite3_int64 bid,
+		const struct location *loc)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = loc->pack},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = loc->offset},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = loc->length},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = bid},
+		}
+	};
+	const char *sql =
+		"UPDATE blobs SET pack = ?, offset = ?, length = ? "
+		"WHERE bid = ?;";
+
+	ks_sql(db, sql, b, 4, NULL, NULL);
+}
+
+static void ks_setpacksize(sqlite3 *db, sqlite3_int64 pack,
+		sqlite3_int64 size)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = size},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = pack},
+		}
+	};
+	const char *sql = "UPDATE packs SET size = ? WHERE pack = ?;";
+
+	ks_sql(db, sql, b, 2, NULL, NULL);
+}
+
+static sqlite3_int64 ks_newpack(sqlite3 *db)
+{
+	const char *sql = "INSERT INTO packs (size) VALUES (0);";
+
+	ks_sql(db, sql, NULL, 0, ks_storeint, NULL);
+	return sqlite3_last_insert_rowid(db);
+}
+
+static void ks_storepack(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct location *loc = arg;
+
+	(void)db;
+
+	loc->pack = sqlite3_column_int64(stmt, 0);
+	loc->offset = sqlite3_column_int64(stmt, 1);
+}
+
+/*
+ * Find where new data should be appended: the end of the newest pack, or of a
+ * new one if that is full. Returns 0 if the library doesn't use packs.
+ */
+static int ks_currentpack(sqlite3 *db, struct location *loc)
+{
+	const char *sql =
+		"SELECT pack, size FROM packs ORDER BY pack DESC LIMIT 1;";
+
+	loc->pack = 0;
+	loc->offset = 0;
+	loc->length = 0;
+	ks_sql(db, sql, NULL, 0, ks_storepack, loc);
+	if (loc->pack == 0)
+		return 0;
+
+	if (loc->offset >= PACKSIZE) {
+		loc->pack = ks_newpack(db);
+		loc->offset = 0;
+	}
+
+	return 1;
+}
+
+/* packed data is stored as it is, so there's no point compressing it first */
+static int ks_usespacks(sqlite3 *db)
+{
+	const char *sql = "SELECT count(*) FROM packs;";
+	sqlite3_int64 n = 0;
+
+	ks_sql(db, sql, NULL, 0, ks_storeint, &n);
+	return n > 0;
+}
+
+/*
+ * Blobs may be stored compressed. Each chunk is compressed on its own, so a
+ * chunk still covers exactly CHUNKSIZE bytes of the document and can be read
+ * back without touching its neighbours.
+ */
+enum codec {
+	CODEC_NONE,
+	CODEC_DEFLATE,
+};
+
+static void ks_setcodec(sqlite3 *db, sqlite3_int64 bid, enum codec codec)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = codec},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = bid},
+		}
+	};
+	const char *sql = "UPDATE blobs SET codec = ? WHERE bid = ?;";
+
+	ks_sql(db, sql, b, 2, NULL, NULL);
+}
+
+static enum codec ks_getcodec(sqlite3 *db, sqlite3_int64 bid)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = bid},
+	};
+	const char *sql = "SELECT codec FROM blobs WHERE bid = ?;";
+	sqlite3_int64 codec = CODEC_NONE;
+
+	ks_sql(db, sql, &b, 1, ks_storeint, &codec);
+	return (enum codec)codec;
+}
+
+/* formats that are already compressed, and so aren't worth compressing again */
+static const struct {
+	const char *magic;
+	size_t len;
+} ks_packed[] = {
+	{ "\x1f\x8b", 2 },				/* gzip */
+	{ "\x28\xb5\x2f\xfd", 4 },			/* zstd */
+	{ "\x89PNG", 4 },				/* PNG */
+	{ "\xfd" "7zXZ", 5 },				/* xz */
+	{ "\xff\xd8\xff", 3 },			/* JPEG */
+	{ "%PDF-", 5 },					/* PDF */
+	{ "7z\xbc\xaf\x27\x1c", 6 },		/* 7-Zip */
+	{ "BZh", 3 },					/* bzip2 */
+	{ "GIF8", 4 },					/* GIF */
+	{ "PK\x03\x04", 4 },				/* ZIP, JAR, EPUB */
+	{ "Rar!", 4 },					/* RAR */
+};
+
+static int ks_compressible(const void *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(ks_packed) / sizeof(ks_packed[0]); i++)
+		if (len >= ks_packed[i].len
+				&& !memcmp(data, ks_packed[i].magic,
+					ks_packed[i].len))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Compress one chunk into dst, which must hold compressBound(CHUNKSIZE) bytes.
+ * Returns the compressed length, or 0 if the chunk couldn't be compressed.
+ */
+static size_t ks_deflate(void *dst, const void *src, size_t len, int level)
+{
+	uLongf n = compressBound(CHUNKSIZE);
+
+	if (compress2(dst, &n, src, len, level) != Z_OK)
+		return 0;
+	return n;
+}
+
+/* a blob is only stored compressed if its first chunk shrinks by an eighth */
+static int ks_worthpacking(size_t len, size_t packed)
+{
+	return packed > 0 && packed <= len - len / 8;
+}
+
+/*
+ * Returns the data of the chunk in a row's first column, inflated into a shared
+ * buffer if the blob is compressed. The chunk's seq is the second column.
+ */
+static const void *ks_chunkdata(sqlite3_stmt *stmt, enum codec codec,
+		size_t *len)
+{
+	static unsigned char *buf;
+	const void *data;
+	uLongf n = CHUNKSIZE;
+
+	data = sqlite3_column_blob(stmt, 0);
+	*len = (size_t)sqlite3_column_bytes(stmt, 0);
+	st.bytesread += (sqlite3_int64)*len;
+	if (codec == CODEC_NONE)
+		return data;
+
+	if (buf == NULL)
+		buf = ks_alloc(&m.cache, CHUNKSIZE);
+
+	if (uncompress(buf, &n, data, (uLong)*len) != Z_OK)
+		ks_errx("corrupt chunk %lld",
+				(long long)sqlite3_column_int64(stmt, 1));
+
+	*len = n;
+	return buf;
+}
+
+/*
+ * A document's data on its way into the library. Regular files are mapped and
+ * hashed up front, which needs nothing but the file itself and so may happen on
+ * any thread. Anything that can't be mapped (pipes, empty files) is left open
+ * for ks_storepayload to stream instead.
+ */
+struct payload {
+	const char *filename;
+	const char *map;
+	sqlite3_int64 size;
+	unsigned char hash[SHA256_LEN];
+	int fd;
+
+	/* compression level (0 for none), and the chunks compressed ahead */
+	int level;
+	unsigned char *packed[PACKAHEAD];
+	size_t packedlen[PACKAHEAD];
+	int npacked;
+
+	/* the call that failed and its errno, if the load failed */
+	const char *op;
+	int err;
+};
+
+static int ks_loadpayload(struct payload *p, const char *filename)
+{
+	struct sha256 ctx;
+	struct stat st;
+	void *map;
+
+	p->filename = filename;
+	p->map = NULL;
+	p->size = 0;
+	p->level = 0;
+	p->npacked = 0;
+	p->op = NULL;
+	p->err = 0;
+
+	p->fd = open(filename, O_RDONLY);
+	if (p->fd < 0) {
+		p->op = "open";
+		p->err = errno;
+		return -1;
+	}
+
+	if (fstat(p->fd, &st) < 0) {
+		p->op = "fstat";
+		p->err = errno;
+		close(p->fd);
+		p->fd = -1;
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0
+			|| (uintmax_t)st.st_size > SIZE_MAX)
+		return 0;
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, p->fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	(void)posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+	p->map = map;
+	p->size = st.st_size;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, p->map, (size_t)p->size);
+	sha256_final(&ctx, p->hash);
+
+	return 0;
+}
+
+/*
+ * Compress a loaded payload at the given level (0 for none). Like loading, this
+ * is safe on any thread, so imports compress on their workers: a mapping's
+ * first PACKAHEAD chunks are compressed here, each into a buffer of its own
+ * size, and any after them one at a time as they are stored. If the first
+ * chunk doesn't pay off the payload is simply stored as it is. A streamed
+ * payload makes the same test on its first chunk as it is stored.
+ */
+static void ks_packpayload(struct payload *p, int level)
+{
+	unsigned char *buf;
+	unsigned char *packed;
+	sqlite3_int64 off;
+	size_t len;
+	size_t zlen;
+
+	p->level = level;
+	if (level == 0 || p->map == NULL)
+		return;
+
+	len = (p->size < CHUNKSIZE) ? (size_t)p->size : CHUNKSIZE;
+	if (!ks_compressible(p->map, len)) {
+		p->level = 0;
+		return;
+	}
+
+	for (off = 0; off < p->size && p->npacked < PACKAHEAD;
+			off += CHUNKSIZE) {
+		len = (p->size - off < CHUNKSIZE)
+			? (size_t)(p->size - off) : CHUNKSIZE;
+		buf = malloc(compressBound(CHUNKSIZE));
+		zlen = (buf == NULL) ? 0 : ks_deflate(buf, p->map + off, len,
+				level);
+
+		if (off == 0 && !ks_worthpacking(len, zlen)) {
+			p->level = 0;
+			free(buf);
+			return;
+		} else if (zlen == 0) {
+			/* the rest is left for storing to compress */
+			free(buf);
+			return;
+		}
+
+		packed = realloc(buf, zlen);
+		p->packed[p->npacked] = (packed == NULL) ? buf : packed;
+		p->packedlen[p->npacked++] = zlen;
+	}
+}
+
+static void ks_closepayload(struct payload *p)
+{
+	while (p->npacked > 0)
+		free(p->packed[--p->npacked]);
+	if (p->map != NULL)
+		munmap((void *)p->map, (size_t)p->size);
+	if (p->fd >= 0)
+		close(p->fd);
+
+	p->map = NULL;
+	p->fd = -1;
+}
+
+static void ks_payloaderr(const struct payload *p)
+{
+	errno = p->err;
+	ks_err("%s(%s)", p->op, p->filename);
+}
+
+/*
+ * In a library with packs, a payload's data is appended to the current pack
+ * uncompressed, in one sequential write for a mapping and a chunk at a time
+ * while hashing for a stream. The pack's size only moves past the data once
+ * it is known to be new.
+ */
+static sqlite3_int64 ks_appendpayload(sqlite3 *db, struct payload *p,
+		struct location *loc)
+{
+	static char *buf;
+	struct packfile *pf;
+	struct sha256 ctx;
+	sqlite3_int64 bid;
+	size_t len;
+
+	if (p->map != NULL) {
+		bid = ks_findblob(db, p->hash);
+		if (bid >= 0) {
+			ks_refblob(db, bid, 1);
+			return bid;
+		}
+
+		pf = ks_packfile(loc->pack, 1);
+		ks_packwrite(pf, p->map, (size_t)p->size, loc->offset);
+	} else {
+		if (buf == NULL)
+			buf = ks_alloc(&m.cache, CHUNKSIZE);
+
+		pf = ks_packfile(loc->pack, 1);
+		sha256_init(&ctx);
+		while ((len = ks_readfull(p->fd, buf, CHUNKSIZE)) > 0) {
+			sha256_update(&ctx, buf, len);
+			ks_packwrite(pf, buf, len, loc->offset + p->size);
+			p->size += (sqlite3_int64)len;
+		}
+		sha256_final(&ctx, p->hash);
+
+		if (p->size == 0)
+			return -1;
+
+		bid = ks_findblob(db, p->hash);
+		if (bid >= 0) {
+			ks_refblob(db, bid, 1);
+			return bid;
+		}
+	}
+
+	loc->length = p->size;
+	bid = ks_newblob(db);
+	ks_setlocation(db, bid, loc);
+	ks_sethash(db, bid, p->hash);
+	ks_setpacksize(db, loc->pack, loc->offset + loc->length);
+
+	return bid;
+}
+
+/*
+ * Store a loaded payload as a blob, returning its id (or -1 if it is empty)
+ * with a reference already taken for the caller. Content that is already in
+ * the library only costs a reference count. Plain mapped chunks are bound
+ * straight out of the mapping, so new data is copied only once, into SQLite's
+ * pages; compressed ones past those compressed ahead by ks_packpayload go
+ * through one chunk-sized buffer. Streamed payloads are written a whole chunk
+ * at a time while they are hashed, and dropped again if they turn out to be
+ * duplicates.
+ */
+static sqlite3_int64 ks_storepayload(sqlite3 *db, struct payload *p)
+{
+	static char *buf;
+	static unsigned char *zbuf;
+	struct sha256 ctx;
+	struct location loc;
+	enum codec codec = CODEC_NONE;
+	sqlite3_int64 bid;
+	sqlite3_int64 dup;
+	sqlite3_int64 off;
+	sqlite3_int64 seq = 0;
+	size_t len;
+	size_t zlen = 0;
+
+	if (ks_currentpack(db, &loc))
+		return ks_appendpayload(db, p, &loc);
+
+	if (buf == NULL) {
+		buf = ks_alloc(&m.cache, CHUNKSIZE);
+		zbuf = ks_alloc(&m.cache, compressBound(CHUNKSIZE));
+	}
+
+	if (p->map != NULL) {
+		bid = ks_findblob(db, p->hash);
+		if (bid >= 0) {
+			ks_refblob(db, bid, 1);
+			return bid;
+		}
+
+		bid = ks_newblob(db);
+		if (p->level > 0)
+			ks_setcodec(db, bid, CODEC_DEFLATE);
+
+		for (off = 0; off < p->size; off += CHUNKSIZE) {
+			len = (p->size - off < CHUNKSIZE)
+				? (size_t)(p->size - off) : CHUNKSIZE;
+			if (p->level == 0) {
+				ks_insertchunk(db, bid, seq++, p->map + off,
+						len);
+				continue;
+			}
+
+			if (seq < p->npacked) {
+				ks_insertchunk(db, bid, seq, p->packed[seq],
+						p->packedlen[seq]);
+				seq++;
+				continue;
+			}
+
+			zlen = ks_deflate(zbuf, p->map + off, len, p->level);
+			if (zlen == 0)
+				ks_errx("can't compress %s", p->filename);
+			ks_insertchunk(db, bid, seq++, zbuf, zlen);
+		}
+		ks_sethash(db, bid, p->hash);
+
+		return bid;
+	}
+
+	sha256_init(&ctx);
+	bid = ks_newblob(db);
+	while ((len = ks_readfull(p->fd, buf, CHUNKSIZE)) > 0) {
+		sha256_update(&ctx, buf, len);
+		p->size += (sqlite3_int64)len;
+
+		if (seq == 0 && p->level > 0 && ks_compressible(buf, len)) {
+			zlen = ks_deflate(zbuf, buf, len, p->level);
+			if (ks_worthpacking(len, zlen)) {
+				codec = CODEC_DEFLATE;
+				ks_setcodec(db, bid, codec);
+			}
+		} else if (codec == CODEC_DEFLATE) {
+			zlen = ks_deflate(zbuf, buf, len, p->level);
+			if (zlen == 0)
+				ks_errx("can't compress %s", p->filename);
+		}
+
+		if (codec == CODEC_DEFLATE)
+			ks_insertchunk(db, bid, seq++, zbuf, zlen);
+		else
+			ks_insertchunk(db, bid, seq++, buf, len);
+	}
+	sha256_final(&ctx, p->hash);
+
+	dup = (p->size == 0) ? -1 : ks_findblob(db, p->hash);
+	if (p->size > 0 && dup < 0) {
+		ks_sethash(db, bid, p->hash);
+		return bid;
+	}
+
+	ks_dropblob(db, bid);
+	if (dup >= 0)
+		ks_refblob(db, dup, 1);
+
+	return dup;
+}
+
+/* returns the document's blob id, 0 if it has no data, or -1 if it's missing */
+static sqlite3_int64 ks_getbid(sqlite3 *db, sqlite3_int64 id)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = id},
+	};
+	const char *sql = "SELECT ifnull(bid, 0) FROM documents WHERE id = ?;";
+	sqlite3_int64 bid = -1;
+
+	ks_sql(db, sql, &b, 1, ks_storeint, &bid);
+	return bid;
+}
+
+/*
+ * Replace a document's data with a loaded payload (or with nothing if p is
+ * NULL), then release the blob it used to reference. Returns the new size of
+ * the document.
+ */
+static sqlite3_int64 ks_setpayload(sqlite3 *db, sqlite3_int64 id,
+		struct payload *p)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_NULL,
+			.value = {.integer = 0},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = id},
+		}
+	};
+	const char *sql =
+		"UPDATE documents SET bid = ?, size = ? WHERE id = ?;";
+	sqlite3_int64 oldbid;
+	sqlite3_int64 bid = -1;
+
+	oldbid = ks_getbid(db, id);
+	if (oldbid < 0)
+		ks_errx("no document with id %lld", id);
+
+	if (p != NULL) {
+		bid = ks_storepayload(db, p);
+		b[1].value.integer = p->size;
+	}
+
+	if (bid >= 0) {
+		b[0].type = BINDING_INTEGER;
+		b[0].value.integer = bid;
+	}
+
+	ks_sql(db, sql, b, 3, NULL, NULL);
+
+	if (oldbid > 0)
+		ks_dropblob(db, oldbid);
+
+	return b[1].value.integer;
+}
+
+static sqlite3_int64 ks_setfile(sqlite3 *db, sqlite3_int64 id,
+		const char *filename, int level)
+{
+	struct payload *p;
+	sqlite3_int64 size;
+
+	if (filename == NULL)
+		return ks_setpayload(db, id, NULL);
+
+	/* kept in m, so that a server can release it if the request fails */
+	p = ks_alloc(&m.arena, sizeof(*p));
+	if (ks_loadpayload(p, filename) < 0)
+		ks_payloaderr(p);
+	m.payload = p;
+	ks_packpayload(p, ks_usespacks(db) ? 0 : level);
+
+	size = ks_setpayload(db, id, p);
+	ks_closepayload(p);
+	m.payload = NULL;
+
+	return size;
+}
+
+static sqlite3_int64 ks_tid(sqlite3 *db, const char *label)
+{
+	struct binding b = {
+		.type = BINDING_TEXT,
+		.value = {.text = label},
+	};
+	const char *sql = "SELECT (tid) FROM tags WHERE label = ?;";
+	const char *insql = "INSERT INTO tags (label) VALUES (?);";
+	sqlite3_int64 tid;
+
+	tid = ks_lookupname(&m.tids, label);
+	if (tid >= 0)
+		return tid;
+
+	ks_sql(db, sql, &b, 1, ks_storeint, &tid);
+
+	if (tid < 0) {
+		ks_sql(db, insql, &b, 1, NULL, NULL);
+		tid = sqlite3_last_insert_rowid(db);
+	}
+
+	return ks_savename(&m.tids, label, tid);
+}
+
+static void ks_inserttag(sqlite3 *db, sqlite3_int64 id, const char *label)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = id},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = -1},
+		}
+	};
+	const char *sql =
+		"INSERT OR IGNORE INTO doctag (id, tid) VALUES (?, ?);";
+	b[1].value.integer = ks_tid(db, label);
+	ks_sql(db, sql, b, 2, NULL, NULL);
+}
+
+static sqlite3_int64 ks_adddocument(sqlite3 *db, const char *title,
+		const char *category)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_TEXT,
+			.value = {.text = title},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = -1},
+		}
+	};
+	const char *sql = "INSERT INTO documents (title, cid) VALUES (?, ?);";
+
+	b[1].value.integer = ks_cid(db, (category == NULL) ? "" : category);
+	ks_sql(db, sql, b, 2, NULL, NULL);
+
+	return sqlite3_last_insert_rowid(db);
+}
+
+/*
+ * Titles and the text of plain-text documents are kept in a contentless FTS5
+ * index keyed by document id. A contentless index doesn't store the text it
+ * was given, so removing a document's entry means handing it the very same
+ * title and text again: always (re)index a document's current state, and
+ * unindex it before changing its title or data.
+ */
+struct text {
+	char *buf;
+	size_t len;
+	size_t cap;
+	enum codec codec;
+	int binary;
+};
+
+static void ks_addtext(const void *data, size_t len, void *arg)
+{
+	struct text *t = arg;
+	char *buf;
+
+	if (t->binary)
+		return;
+
+	if (memchr(data, '\0', len) != NULL) {
+		t->binary = 1;
+		return;
+	}
+
+	if (t->len + len >= t->cap) {
+		t->cap = (t->len + len) * 2;
+		buf = realloc(t->buf, t->cap);
+		if (buf == NULL)
+			ks_err("realloc");
+		t->buf = m.text = buf;
+	}
+
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+	t->buf[t->len] = '\0';
+}
+
+static void ks_readtext(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct text *t = arg;
+	const void *data;
+	size_t len;
+
+	(void)db;
+
+	if (t->binary)
+		return;
+
+	data = ks_chunkdata(stmt, t->codec, &len);
+	ks_addtext(data, len, t);
+}
+
+/* reads the text of a blob kept in chunks, as every blob was before packs */
+static void ks_readchunks(sqlite3 *db, sqlite3_int64 bid, struct text *t)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = bid},
+	};
+	const char *sql =
+		"SELECT data, seq FROM chunks "
+		"WHERE bid = ? AND seq < " MAKESTR(TEXTCHUNKS) " ORDER BY seq;";
+
+	t->codec = ks_getcodec(db, bid);
+	ks_sql(db, sql, &b, 1, ks_readtext, t);
+}
+
+/* (un)indexes a document's title along with text read from its data */
+static void ks_indextext(sqlite3 *db, sqlite3_int64 id, int remove,
+		struct text *t)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = id},
+		}, {
+			.type = BINDING_NULL,
+			.value = {.integer = 0},
+		}
+	};
+	const char *addsql =
+		"INSERT INTO search (rowid, title, body) "
+			"SELECT id, title, ?2 FROM documents WHERE id = ?1;";
+	const char *removesql =
+		"INSERT INTO search (search, rowid, title, body) "
+			"SELECT 'delete', id, title, ?2 FROM documents "
+			"WHERE id = ?1;";
+
+	if (t->len > 0 && !t->binary) {
+		b[1].type = BINDING_TEXT;
+		b[1].value.text = t->buf;
+	}
+
+	ks_sql(db, remove ? removesql : addsql, b, 2, NULL, NULL);
+	free(t->buf);
+	t->buf = m.text = NULL;
+}
+
+static void ks_indexdocument(sqlite3 *db, sqlite3_int64 id, int remove)
+{
+	struct text t = {
+		.buf = NULL,
+		.len = 0,
+		.cap = 0,
+		.codec = CODEC_NONE,
+		.binary = 0,
+	};
+	struct location loc = {.pack = 0, .offset = 0, .length = 0};
+	sqlite3_int64 bid, end;
+
+	bid = ks_getbid(db, id);
+	if (bid > 0)
+		ks_getlocation(db, bid, &loc);
+
+	if (loc.pack > 0) {
+		end = (loc.length < (sqlite3_int64)TEXTCHUNKS * CHUNKSIZE)
+			? loc.length : (sqlite3_int64)TEXTCHUNKS * CHUNKSIZE;
+		ks_readpack(&loc, 0, end, ks_addtext, &t);
+	} else if (bid > 0) {
+		ks_readchunks(db, bid, &t);
+	}
+
+	ks_indextext(db, id, remove, &t);
+}
+
+static void ks_add(const struct config *cfg)
+{
+	sqlite3 *db;
+	struct tag *t;
+	sqlite3_int64 id;
+
+	if (cfg->title == NULL)
+		ks_errx("title is required when adding a document");
+
+	db = ks_open(cfg->database);
+	ks_begin(db);
+
+	id = ks_adddocument(db, cfg->title, cfg->category);
+
+	if (cfg->file != NULL)
+		ks_setfile(db, id, cfg->file, cfg->compress);
+
+	for (t = cfg->tags; t != NULL; t = t->next)
+		ks_inserttag(db, id, t->label);
+
+	ks_indexdocument(db, id, 0);
+
+	ks_end(db);
+}
+
+struct import {
+	struct timespec start;
+	sqlite3_int64 ndocs;
+	sqlite3_int64 nbytes;
+	int progress;
+};
+
+static void ks_importprogress(const struct import *imp, const char *end)
+{
+	struct timespec now;
+	double elapsed;
+
+	if (!imp->progress)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (double)(now.tv_sec - imp->start.tv_sec)
+		+ (double)(now.tv_nsec - imp->start.tv_nsec) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	fprintf(stderr, "\rks: imported %lld documents, %.1f MiB "
+			"(%.0f documents/s, %.1f MiB/s)%s",
+			imp->ndocs, (double)imp->nbytes / 1048576,
+			(double)imp->ndocs / elapsed,
+			(double)imp->nbytes / 1048576 / elapsed, end);
+}
+
+/*
+ * One manifest record: a document's file, title, category, and any number of
+ * tags, separated by tabs. An empty file or category field means the document
+ * has none.
+ */
+enum jobstate {
+	JOB_EMPTY,
+	JOB_PENDING,
+	JOB_BUSY,
+	JOB_READY,
+};
+
+struct job {
+	enum jobstate state;
+	sqlite3_int64 lineno;
+	char *record;
+	char *fields[3];
+	char *tags;
+	struct payload payload;
+	int loaded;
+};
+
+/*
+ * Imports run as a pipeline: the main thread parses records into a ring of
+ * jobs, a pool of workers loads (maps, hashes and compresses the start of)
+ * each job's file, and the main thread, which alone owns the database handle,
+ * writes the jobs back out in manifest order as they become ready.
+ */
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct job *jobs;
+	size_t njobs;
+	size_t next;
+	int level;
+	int closing;
+};
+
+static void ks_parserecord(struct job *job, char *record, sqlite3_int64 lineno)
+{
+	char *p = record;
+	size_t i;
+
+	job->record = record;
+	job->lineno = lineno;
+	for (i = 0; i < 3; i++)
+		job->fields[i] = NULL;
+
+	for (i = 0; i < 3 && p != NULL; i++) {
+		job->fields[i] = p;
+		p = strchr(p, '\t');
+		if (p != NULL)
+			*p++ = '\0';
+	}
+	job->tags = p;
+
+	if (job->fields[1] == NULL || *job->fields[1] == '\0')
+		ks_errx("record %lld: title is required", lineno);
+}
+
+static void *ks_importworker(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct job *job;
+
+	pthread_mutex_lock(&pl->lock);
+	for (;;) {
+		job = &pl->jobs[pl->next];
+		if (job->state != JOB_PENDING) {
+			if (pl->closing)
+				break;
+			pthread_cond_wait(&pl->work, &pl->lock);
+			continue;
+		}
+
+		job->state = JOB_BUSY;
+		pl->next = (pl->next + 1) % pl->njobs;
+		pthread_mutex_unlock(&pl->lock);
+
+		job->loaded = (*job->fields[0] != '\0');
+		if (job->loaded && ks_loadpayload(&job->payload,
+					job->fields[0]) == 0)
+			ks_packpayload(&job->payload, pl->level);
+
+		pthread_mutex_lock(&pl->lock);
+		job->state = JOB_READY;
+		pthread_cond_broadcast(&pl->done);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static void ks_importjob(sqlite3 *db, struct job *job, struct import *imp)
+{
+	sqlite3_int64 id;
+	char *next;
+	char *p;
+
+	if (job->loaded && job->payload.err != 0)
+		ks_payloaderr(&job->payload);
+
+	id = ks_adddocument(db, job->fields[1], job->fields[2]);
+
+	if (job->loaded) {
+		imp->nbytes += ks_setpayload(db, id, &job->payload);
+		ks_closepayload(&job->payload);
+	}
+
+	for (p = job->tags; p != NULL; p = next) {
+		next = strchr(p, '\t');
+		if (next != NULL)
+			*next++ = '\0';
+		if (*p != '\0')
+			ks_inserttag(db, id, p);
+	}
+
+	ks_indexdocument(db, id, 0);
+
+	imp->ndocs++;
+}
+
+static void ks_import(const struct config *cfg)
+{
+	struct import imp = {
+		.ndocs = 0,
+		.nbytes = 0,
+		.progress = isatty(STDERR_FILENO),
+	};
+	struct pipeline pl = {
+		.jobs = NULL,
+		.njobs = 0,
+		.next = 0,
+		.level = cfg->compress,
+		.closing = 0,
+	};
+	pthread_t *workers;
+	struct job *job;
+	sqlite3 *db;
+	FILE *fp = stdin;
+	char *record = NULL;
+	size_t cap = 0;
+	size_t head = 0;
+	size_t tail = 0;
+	size_t inflight = 0;
+	ssize_t len;
+	sqlite3_int64 lineno = 0;
+	long nworkers = cfg->jobs;
+	long i;
+	int delim = cfg->nul ? '\0' : '\n';
+	int eof = 0;
+	int rc;
+
+	if (cfg->batch <= 0)
+		ks_errx("batch size must be positive");
+
+	if (nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+
+	if (cfg->file != NULL) {
+		fp = fopen(cfg->file, "r");
+		if (fp == NULL)
+			ks_err("fopen(%s)", cfg->file);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &imp.start);
+
+	db = ks_open(cfg->database);
+	if (ks_usespacks(db))
+		pl.level = 0;
+
+	pl.njobs = (size_t)nworkers * 4;
+	pl.jobs = ks_alloc(&m.arena, pl.njobs * sizeof(*pl.jobs));
+	for (i = 0; i < (long)pl.njobs; i++)
+		pl.jobs[i].state = JOB_EMPTY;
+	workers = ks_alloc(&m.arena, (size_t)nworkers * sizeof(*workers));
+
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.work, NULL);
+	pthread_cond_init(&pl.done, NULL);
+	for (i = 0; i < nworkers; i++) {
+		rc = pthread_create(&workers[i], NULL, ks_importworker, &pl);
+		if (rc != 0) {
+			errno = rc;
+			ks_err("pthread_create");
+		}
+	}
+
+	ks_begin(db);
+
+	for (;;) {
+		while (!eof && inflight < pl.njobs) {
+			len = getdelim(&record, &cap, delim, fp);
+			if (len < 0) {
+				eof = 1;
+				break;
+			}
+
+			lineno++;
+			if (len > 0 && record[len - 1] == delim)
+				record[--len] = '\0';
+			if (len == 0)
+				continue;
+
+			job = &pl.jobs[tail];
+			ks_parserecord(job, record, lineno);
+			record = NULL;
+			cap = 0;
+
+			pthread_mutex_lock(&pl.lock);
+			job->state = JOB_PENDING;
+			pthread_cond_signal(&pl.work);
+			pthread_mutex_unlock(&pl.lock);
+
+			tail = (tail + 1) % pl.njobs;
+			inflight++;
+		}
+
+		if (inflight == 0)
+			break;
+
+		job = &pl.jobs[head];
+		pthread_mutex_lock(&pl.lock);
+		while (job->state != JOB_READY)
+			pthread_cond_wait(&pl.done, &pl.lock);
+		pthread_mutex_unlock(&pl.lock);
+
+		ks_importjob(db, job, &imp);
+		free(job->record);
+
+		pthread_mutex_lock(&pl.lock);
+		job->state = JOB_EMPTY;
+		pthread_mutex_unlock(&pl.lock);
+
+		head = (head + 1) % pl.njobs;
+		inflight--;
+
+		if (imp.ndocs % cfg->batch == 0) {
+			ks_end(db);
+			ks_importprogress(&imp, "");
+			ks_begin(db);
+		}
+	}
+
+	if (ferror(fp))
+		ks_err("reading manifest");
+	free(record);
+	if (fp != stdin)
+		fclose(fp);
+
+	pthread_mutex_lock(&pl.lock);
+	pl.closing = 1;
+	pthread_cond_broadcast(&pl.work);
+	pthread_mutex_unlock(&pl.lock);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	ks_end(db);
+	ks_importprogress(&imp, "\n");
+}
+
+/*
+ * Ids on the command line are single ids or inclusive ranges, resolved up
+ * front to the documents that exist, in the order given. A single id must
+ * name a document when required; a range covers whichever documents are in
+ * it.
+ */
+struct idlist {
+	sqlite3_int64 *ids;
+	size_t n;
+	size_t cap;
+};
+
+static void ks_storeid(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct idlist *l = arg;
+	sqlite3_int64 *ids;
+
+	(void)db;
+
+	if (l->n == l->cap) {
+		l->cap = (l->cap == 0) ? 64 : l->cap * 2;
+		ids = ks_alloc(&m.arena, l->cap * sizeof(*ids));
+		if (l->n > 0)
+			memcpy(ids, l->ids, l->n * sizeof(*ids));
+		l->ids = ids;
+	}
+
+	l->ids[l->n++] = sqlite3_column_int64(stmt, 0);
+}
+
+static void ks_selectids(sqlite3 *db, const struct config *cfg,
+		struct idlist *l, int required)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}
+	};
+	const char *sql =
+		"SELECT id FROM documents WHERE id BETWEEN ? AND ? "
+			"ORDER BY id;";
+	const struct idrange *r;
+	size_t n;
+
+	for (r = cfg->ids; r != NULL; r = r->next) {
+		if (r->first > r->last)
+			ks_errx("invalid id range %lld-%lld", r->first,
+					r->last);
+
+		b[0].value.integer = r->first;
+		b[1].value.integer = r->last;
+		n = l->n;
+		ks_sql(db, sql, b, 2, ks_storeid, l);
+
+		if (required && l->n == n && r->first == r->last)
+			ks_errx("no document with id %lld", r->first);
+	}
+}
+
+static void ks_writechunk(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	const enum codec *codec = arg;
+	const void *data;
+	size_t len;
+
+	(void)db;
+
+	data = ks_chunkdata(stmt, *codec, &len);
+	ks_writefull(STDOUT_FILENO, data, len);
+}
+
+static void ks_writedata(const void *data, size_t len, void *arg)
+{
+	(void)arg;
+
+	ks_writefull(STDOUT_FILENO, data, len);
+}
+
+static void ks_storesize(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	sqlite3_int64 *doc = arg;
+
+	(void)db;
+
+	doc[0] = sqlite3_column_int64(stmt, 0);
+	doc[1] = sqlite3_column_int64(stmt, 1);
+}
+
+/*
+ * Byte ranges are read from only the chunks they overlap. Plain chunks are
+ * read in place through one incremental blob handle, moved from row to row,
+ * so a peek at a large document costs about the bytes asked for; compressed
+ * chunks have to be inflated whole.
+ */
+struct slice {
+	sqlite3_int64 start;
+	sqlite3_int64 end;
+	enum codec codec;
+};
+
+static void ks_closeblob(void)
+{
+	if (m.blob != NULL)
+		sqlite3_blob_close(m.blob);
+	m.blob = NULL;
+}
+
+static void ks_writeslice(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	static char *buf;
+	const struct slice *sl = arg;
+	const char *data;
+	sqlite3_int64 base;
+	sqlite3_int64 from;
+	sqlite3_int64 to;
+	sqlite3_int64 row;
+	size_t len;
+	int rc;
+
+	base = sqlite3_column_int64(stmt, 1) * CHUNKSIZE;
+	from = (sl->start > base) ? sl->start - base : 0;
+	to = (sl->end < base + CHUNKSIZE) ? sl->end - base : CHUNKSIZE;
+
+	if (sl->codec != CODEC_NONE) {
+		data = ks_chunkdata(stmt, sl->codec, &len);
+		if ((sqlite3_int64)len < to)
+			to = (sqlite3_int64)len;
+		if (from < to)
+			ks_writefull(STDOUT_FILENO, data + from,
+					(size_t)(to - from));
+		return;
+	}
+
+	if (buf == NULL)
+		buf = ks_alloc(&m.cache, CHUNKSIZE);
+
+	row = sqlite3_column_int64(stmt, 0);
+	if (m.blob == NULL)
+		rc = sqlite3_blob_open(db, "main", "chunks", "data", row, 0,
+				&m.blob);
+	else
+		rc = sqlite3_blob_reopen(m.blob, row);
+	if (rc != SQLITE_OK)
+		ks_errx("can't open chunk: %s", sqlite3_errmsg(db));
+
+	if (sqlite3_blob_bytes(m.blob) < to)
+		to = sqlite3_blob_bytes(m.blob);
+	if (from >= to)
+		return;
+
+	rc = sqlite3_blob_read(m.blob, buf, (int)(to - from), (int)from);
+	if (rc != SQLITE_OK)
+		ks_errx("can't read chunk: %s", sqlite3_errmsg(db));
+	st.bytesread += to - from;
+	ks_writefull(STDOUT_FILENO, buf, (size_t)(to - from));
+}
+
+/* clip a range to the document; negative offsets count back from its end */
+static void ks_cliprange(const struct byterange *r, sqlite3_int64 size,
+		struct slice *sl)
+{
+	if (r->offset < 0)
+		sl->start = (size + r->offset > 0) ? size + r->offset : 0;
+	else
+		sl->start = (r->offset < size) ? r->offset : size;
+
+	if (r->length < 0 || r->length > size - sl->start)
+		sl->end = size;
+	else
+		sl->end = sl->start + r->length;
+}
+
+/*
+ * With framing, each document is preceded by a line holding its id and the
+ * number of bytes that follow, so that a reader can split the stream back up.
+ */
+static void ks_catdocument(sqlite3 *db, sqlite3_int64 id,
+		const struct config *cfg)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = id},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}
+	};
+	const char *docsql =
+		"SELECT ifnull(bid, 0), size FROM documents WHERE id = ?;";
+	const char *sql =
+		"SELECT data, seq FROM chunks WHERE bid = ? ORDER BY seq;";
+	const char *rowsql =
+		"SELECT rowid, seq FROM chunks "
+		"WHERE bid = ? AND seq BETWEEN ? AND ? ORDER BY seq;";
+	const char *datasql =
+		"SELECT data, seq FROM chunks "
+		"WHERE bid = ? AND seq BETWEEN ? AND ? ORDER BY seq;";
+	const struct byterange *r;
+	sqlite3_int64 doc[2] = {0, 0};
+	sqlite3_int64 total = 0;
+	struct location loc;
+	struct slice sl;
+	char frame[64];
+	int len;
+
+	ks_sql(db, docsql, b, 1, ks_storesize, doc);
+	sl.codec = ks_getcodec(db, doc[0]);
+
+	for (r = cfg->ranges; r != NULL; r = r->next) {
+		ks_cliprange(r, doc[1], &sl);
+		total += sl.end - sl.start;
+	}
+	if (cfg->ranges == NULL)
+		total = doc[1];
 
-	rc = sqlite3_blob_open(db, "main", "documents", "data", cfg->id, 0, &blob);
-	if (rc != SQLITE_OK)
-		ks_errx("blob_open: %s", sqlite3_errmsg(db));
+	if (cfg->framed) {
+		len = snprintf(frame, sizeof(frame), "%lld %lld\n", id, total);
+		ks_writefull(STDOUT_FILENO, frame, (size_t)len);
+	}
 
-	remaining = sqlite3_blob_bytes(blob);
-	offset = 0;
-	do {
-		int len;
+	b[0].value.integer = doc[0];
+	ks_getlocation(db, doc[0], &loc);
+	if (cfg->ranges == NULL && loc.pack > 0) {
+		ks_readpack(&loc, 0, loc.length, ks_writedata, NULL);
+		return;
+	} else if (cfg->ranges == NULL) {
+		ks_sql(db, sql, b, 1, ks_writechunk, &sl.codec);
+		return;
+	}
 
-		len = (remaining < IOSIZE) ? remaining : IOSIZE;
-		rc = sqlite3_blob_read(blob, buf, len, offset);
-		if (rc != SQLITE_OK)
-			ks_errx("blob_read: %s", sqlite3_errmsg(db));
-		(void)fwrite(buf, 1, (size_t)len, stdout);
+	for (r = cfg->ranges; r != NULL; r = r->next) {
+		ks_cliprange(r, doc[1], &sl);
+		if (sl.start == sl.end)
+			continue;
 
-		remaining -= len;
-		offset += len;
-	} while (remaining > 0);
+		if (loc.pack > 0) {
+			ks_readpack(&loc, sl.start, sl.end, ks_writedata, NULL);
+			continue;
+		}
+
+		b[1].value.integer = sl.start / CHUNKSIZE;
+		b[2].value.integer = (sl.end - 1) / CHUNKSIZE;
+		ks_sql(db, (sl.codec == CODEC_NONE) ? rowsql : datasql, b, 3,
+				ks_writeslice, &sl);
+	}
+}
+
+static void ks_cat(const struct config *cfg)
+{
+	struct idlist l = {.ids = NULL, .n = 0, .cap = 0};
+	sqlite3 *db;
+	size_t i;
+
+	if (cfg->ids == NULL)
+		ks_errx("cat command requires an id");
+
+	db = ks_open(cfg->database);
+	ks_beginread(db);
+
+	ks_selectids(db, cfg, &l, 1);
+	for (i = 0; i < l.n; i++)
+		ks_catdocument(db, l.ids[i], cfg);
 
-	sqlite3_blob_close(blob);
+	ks_closeblob();
+	ks_end(db);
 }
 
 static void ks_printtext(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
@@ -507,6 +2508,337 @@ static void ks_categories(const struct config *cfg)
 	ks_sql(db, sql, NULL, 0, ks_printtext, NULL);
 }
 
+/*
+ * Everything shell completion needs in one process and one read transaction:
+ * document ids as they are, categories prefixed with '@' and tags with '+',
+ * each read straight off an index and terminated by a newline (or a NUL).
+ */
+struct listing {
+	const char *prefix;
+	int delim;
+};
+
+static void ks_printname(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	const struct listing *l = arg;
+	const unsigned char *name;
+
+	(void)db;
+
+	name = sqlite3_column_text(stmt, 0);
+	fputs(l->prefix, stdout);
+	fwrite(name, 1, (size_t)sqlite3_column_bytes(stmt, 0), stdout);
+	putchar(l->delim);
+}
+
+static void ks_complete(const struct config *cfg)
+{
+	struct listing ids = {.prefix = "", .delim = cfg->nul ? '\0' : '\n'};
+	struct listing categories = {.prefix = "@", .delim = ids.delim};
+	struct listing tags = {.prefix = "+", .delim = ids.delim};
+	sqlite3 *db;
+
+	db = ks_open(cfg->database);
+	ks_beginread(db);
+
+	ks_sql(db, "SELECT id FROM documents ORDER BY id;", NULL, 0,
+			ks_printname, &ids);
+	ks_sql(db, "SELECT cname FROM categories ORDER BY cname;", NULL, 0,
+			ks_printname, &categories);
+	ks_sql(db, "SELECT label FROM tags ORDER BY label;", NULL, 0,
+			ks_printname, &tags);
+
+	ks_end(db);
+}
+
+/*
+ * Schema upgrades, indexed by the version they upgrade from. New databases are
+ * created with the version 0 layout and then brought up to date through these
+ * same steps, so there is only one definition of each schema version.
+ */
+struct migration {
+	const char *sql;
+	void (*fn)(sqlite3 *db);
+};
+
+static void ks_dedupblobs(sqlite3 *db);
+static void ks_indexdocuments(sqlite3 *db);
+
+static const struct migration ks_migrations[DB_VERSION] = {
+	/* 0 -> 1: unique names, doctag primary key, and lookup indexes */
+	{ .sql =
+	"UPDATE documents SET cid = ("
+		"SELECT min(c.cid) FROM categories AS c "
+		"WHERE c.cname = ("
+			"SELECT cname FROM categories "
+			"WHERE cid = documents.cid"
+		")"
+	") WHERE cid IN (SELECT cid FROM categories) "
+		"AND cid NOT IN ("
+			"SELECT min(cid) FROM categories GROUP BY cname"
+		");"
+	"DELETE FROM categories WHERE cid NOT IN ("
+		"SELECT min(cid) FROM categories GROUP BY cname"
+	");"
+	"UPDATE doctag SET tid = ("
+		"SELECT min(t.tid) FROM tags AS t "
+		"WHERE t.label = ("
+			"SELECT label FROM tags WHERE tid = doctag.tid"
+		")"
+	") WHERE tid IN (SELECT tid FROM tags) "
+		"AND tid NOT IN ("
+			"SELECT min(tid) FROM tags GROUP BY label"
+		");"
+	"DELETE FROM tags WHERE tid NOT IN ("
+		"SELECT min(tid) FROM tags GROUP BY label"
+	");"
+	"CREATE UNIQUE INDEX categories_cname ON categories (cname);"
+	"CREATE UNIQUE INDEX tags_label ON tags (label);"
+	"CREATE INDEX documents_cid ON documents (cid);"
+	"CREATE TABLE doctag_v1 ("
+		"id INTEGER NOT NULL,"
+		"tid INTEGER NOT NULL,"
+		"PRIMARY KEY (id, tid),"
+		"FOREIGN KEY (id) REFERENCES documents(id),"
+		"FOREIGN KEY (tid) REFERENCES tags(tid)"
+	") WITHOUT ROWID;"
+	"INSERT OR IGNORE INTO doctag_v1 (id, tid) "
+		"SELECT id, tid FROM doctag "
+		"WHERE id IS NOT NULL AND tid IS NOT NULL;"
+	"DROP TABLE doctag;"
+	"ALTER TABLE doctag_v1 RENAME TO doctag;"
+	"CREATE INDEX doctag_tid ON doctag (tid, id);" },
+
+	/* 1 -> 2: move document data into fixed-size chunks */
+	{ .sql =
+	"CREATE TABLE chunks ("
+		"id INTEGER NOT NULL,"
+		"seq INTEGER NOT NULL,"
+		"data BLOB NOT NULL,"
+		"UNIQUE (id, seq),"
+		"FOREIGN KEY (id) REFERENCES documents(id)"
+	");"
+	"ALTER TABLE documents ADD COLUMN size INTEGER NOT NULL DEFAULT 0;"
+	"UPDATE documents SET size = length(data) WHERE data IS NOT NULL;"
+	"WITH RECURSIVE split(id, seq) AS ("
+		"SELECT id, 0 FROM documents WHERE size > 0 "
+		"UNION ALL "
+		"SELECT split.id, split.seq + 1 "
+		"FROM split INNER JOIN documents "
+			"ON split.id = documents.id "
+		"WHERE (split.seq + 1) * " MAKESTR(CHUNKSIZE) " < size"
+	") "
+	"INSERT INTO chunks (id, seq, data) "
+		"SELECT split.id, split.seq, substr(data, "
+			"split.seq * " MAKESTR(CHUNKSIZE) " + 1, "
+			MAKESTR(CHUNKSIZE) ") "
+		"FROM split INNER JOIN documents "
+			"ON split.id = documents.id;"
+	"UPDATE documents SET data = NULL;" },
+
+	/* 2 -> 3: share identical data between documents */
+	{ .sql =
+	"CREATE TABLE blobs ("
+		"bid INTEGER PRIMARY KEY,"
+		"hash BLOB UNIQUE,"
+		"refs INTEGER NOT NULL"
+	");"
+	"ALTER TABLE documents ADD COLUMN bid INTEGER REFERENCES blobs(bid);"
+	"ALTER TABLE chunks RENAME TO chunks_v2;"
+	"CREATE TABLE chunks ("
+		"bid INTEGER NOT NULL,"
+		"seq INTEGER NOT NULL,"
+		"data BLOB NOT NULL,"
+		"UNIQUE (bid, seq),"
+		"FOREIGN KEY (bid) REFERENCES blobs(bid)"
+	");",
+	.fn = ks_dedupblobs },
+
+	/* 3 -> 4: optional compression of each blob's chunks */
+	{ .sql =
+	"ALTER TABLE blobs ADD COLUMN codec INTEGER NOT NULL DEFAULT 0;" },
+
+	/* 4 -> 5: full-text index over titles and plain-text data */
+	{ .sql =
+	"CREATE VIRTUAL TABLE search USING fts5 (title, body, content = '');"
+	"INSERT INTO search (search, rank) VALUES ('rank', 'bm25(10.0, 1.0)');",
+	.fn = ks_indexdocuments },
+
+	/* 5 -> 6: drop dangling tags, and a document's tags along with it */
+	{ .sql =
+	"CREATE TABLE doctag_v6 ("
+		"id INTEGER NOT NULL,"
+		"tid INTEGER NOT NULL,"
+		"PRIMARY KEY (id, tid),"
+		"FOREIGN KEY (id) REFERENCES documents(id) ON DELETE CASCADE,"
+		"FOREIGN KEY (tid) REFERENCES tags(tid)"
+	") WITHOUT ROWID;"
+	"INSERT INTO doctag_v6 (id, tid) "
+		"SELECT id, tid FROM doctag "
+		"WHERE id IN (SELECT id FROM documents) "
+			"AND tid IN (SELECT tid FROM tags);"
+	"DROP TABLE doctag;"
+	"ALTER TABLE doctag_v6 RENAME TO doctag;"
+	"CREATE INDEX doctag_tid ON doctag (tid, id);" },
+
+	/* 6 -> 7: narrow documents to metadata, without the old data column */
+	{ .sql =
+	"CREATE TABLE documents_v7 ("
+		"id INTEGER PRIMARY KEY,"
+		"title TEXT,"
+		"cid INTEGER,"
+		"bid INTEGER,"
+		"size INTEGER NOT NULL DEFAULT 0,"
+		"FOREIGN KEY (cid) REFERENCES categories(cid),"
+		"FOREIGN KEY (bid) REFERENCES blobs(bid)"
+	");"
+	"INSERT INTO documents_v7 (id, title, cid, bid, size) "
+		"SELECT id, title, cid, bid, size FROM documents ORDER BY id;"
+	"DROP TABLE documents;"
+	"ALTER TABLE documents_v7 RENAME TO documents;"
+	"CREATE INDEX documents_cid ON documents (cid);" },
+
+	/* 7 -> 8: optional pack files holding blob data outside the database */
+	{ .sql =
+	"CREATE TABLE packs ("
+		"pack INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"size INTEGER NOT NULL DEFAULT 0,"
+		"dead INTEGER NOT NULL DEFAULT 0"
+	");"
+	"ALTER TABLE blobs ADD COLUMN pack INTEGER REFERENCES packs(pack);"
+	"ALTER TABLE blobs ADD COLUMN offset INTEGER;"
+	"ALTER TABLE blobs ADD COLUMN length INTEGER;"
+	"CREATE INDEX blobs_pack ON blobs (pack, offset) "
+		"WHERE pack IS NOT NULL;" },
+};
+
+static void ks_hashchunk(sqlite3 *db, sqlite3_stmt *stmt, void *ctx)
+{
+	(void)db;
+
+	sha256_update(ctx, sqlite3_column_blob(stmt, 0),
+			(size_t)sqlite3_column_bytes(stmt, 0));
+}
+
+static void ks_dedupdocument(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct binding b[] = {
+		{
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}, {
+			.type = BINDING_INTEGER,
+			.value = {.integer = 0},
+		}
+	};
+	const char *hashsql =
+		"SELECT data FROM chunks_v2 WHERE id = ? ORDER BY seq;";
+	const char *copysql =
+		"INSERT INTO chunks (bid, seq, data) "
+			"SELECT ?, seq, data FROM chunks_v2 WHERE id = ?;";
+	const char *sql = "UPDATE documents SET bid = ? WHERE id = ?;";
+	unsigned char hash[SHA256_LEN];
+	struct sha256 ctx;
+	sqlite3_int64 bid;
+
+	(void)arg;
+
+	b[1].value.integer = sqlite3_column_int64(stmt, 0);
+
+	sha256_init(&ctx);
+	ks_sql(db, hashsql, &b[1], 1, ks_hashchunk, &ctx);
+	sha256_final(&ctx, hash);
+
+	bid = ks_findblob(db, hash);
+	if (bid >= 0) {
+		ks_refblob(db, bid, 1);
+	} else {
+		bid = ks_newblob(db);
+		b[0].value.integer = bid;
+		ks_sql(db, copysql, b, 2, NULL, NULL);
+		ks_sethash(db, bid, hash);
+	}
+
+	b[0].value.integer = bid;
+	ks_sql(db, sql, b, 2, NULL, NULL);
+}
+
+static void ks_dedupblobs(sqlite3 *db)
+{
+	const char *sql = "SELECT id FROM documents WHERE size > 0;";
+	int rc;
+
+	ks_sql(db, sql, NULL, 0, ks_dedupdocument, NULL);
+
+	rc = sqlite3_exec(db, "DROP TABLE chunks_v2;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK)
+		ks_errx("can't drop old chunks: %s", sqlite3_errmsg(db));
+}
+
+/* a version 4 database keeps every blob in chunks, and has no packs to read */
+static void ks_indexrow(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct text t = {
+		.buf = NULL,
+		.len = 0,
+		.cap = 0,
+		.codec = CODEC_NONE,
+		.binary = 0,
+	};
+	sqlite3_int64 id, bid;
+
+	(void)arg;
+
+	id = sqlite3_column_int64(stmt, 0);
+	bid = ks_getbid(db, id);
+	if (bid > 0)
+		ks_readchunks(db, bid, &t);
+
+	ks_indextext(db, id, 0, &t);
+}
+
+static void ks_indexdocuments(sqlite3 *db)
+{
+	const char *sql = "SELECT id FROM documents;";
+
+	ks_sql(db, sql, NULL, 0, ks_indexrow, NULL);
+}
+
+/*
+ * Foreign keys are off while migrating: older layouts may already break them,
+ * and rebuilding a table must not cascade into the tables that reference it.
+ */
+static void ks_upgrade(sqlite3 *db)
+{
+	sqlite3_int64 v;
+	int rc;
+
+	v = ks_getversion(db);
+	if (v < 0 || v > DB_VERSION)
+		ks_errx("can't migrate from database version %lld", v);
+
+	ks_foreignkeys(db, 0);
+	for (; v < DB_VERSION; v++) {
+		ks_begin(db);
+
+		rc = sqlite3_exec(db, ks_migrations[v].sql, NULL, NULL, NULL);
+		if (rc != SQLITE_OK)
+			ks_errx("migration from version %lld failed: %s", v,
+					sqlite3_errmsg(db));
+		if (ks_migrations[v].fn != NULL)
+			ks_migrations[v].fn(db);
+
+		rc = sqlite3_exec(db, "UPDATE version SET v = v + 1;",
+				NULL, NULL, NULL);
+		if (rc != SQLITE_OK)
+			ks_errx("can't update database version: %s",
+					sqlite3_errmsg(db));
+
+		ks_end(db);
+	}
+	ks_foreignkeys(db, 1);
+}
+
 static void ks_init(const struct config *cfg)
 {
 	const char *sql =
@@ -533,7 +2865,7 @@ static void ks_init(const struct config *cfg)
 			"FOREIGN KEY (tid) REFERENCES tags(tid)"
 		");"
 		"CREATE TABLE version (v INTEGER);"
-		"INSERT INTO version (v) VALUES (" MAKESTR(VERSION_MAJOR) ");"
+		"INSERT INTO version (v) VALUES (0);"
 		"END;";
 	sqlite3 *db;
 	int rc;
@@ -545,10 +2877,34 @@ static void ks_init(const struct config *cfg)
 		ks_errx("can't create database %s: %s", cfg->database,
 				sqlite3_errmsg(db));
 
+	ks_setpath(cfg->database);
+	ks_settrace(db);
+
+	/* only takes effect before the first table, and so before WAL mode */
+	rc = sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;",
+			NULL, NULL, NULL);
+	if (rc != SQLITE_OK)
+		ks_errx("can't set auto_vacuum: %s", sqlite3_errmsg(db));
+
+	ks_tune(db);
+
 	rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
 	if (rc != SQLITE_OK)
 		ks_errx("table creation failed: %s",
 				sqlite3_errmsg(db));
+
+	ks_upgrade(db);
+
+	if (cfg->packs)
+		ks_newpack(db);
+}
+
+static void ks_migrate(const struct config *cfg)
+{
+	sqlite3 *db;
+
+	db = ks_opendb(cfg->database);
+	ks_upgrade(db);
 }
 
 static void ks_settitle(sqlite3 *db, sqlite3_int64 id, const char *title)
@@ -584,359 +2940,872 @@ static void ks_setcategory(sqlite3 *db, sqlite3_int64 id, const char *category)
 	ks_sql(db, sql, b, 2, NULL, NULL);
 }
 
-static void ks_setfile(sqlite3 *db, sqlite3_int64 id, const char *filename)
+/* point a document at another's data, which is only loaded once per mod */
+static void ks_sharedata(sqlite3 *db, sqlite3_int64 id, sqlite3_int64 from)
 {
 	struct binding b[] = {
 		{
-			.type = BINDING_BLOB,
-			.value = {.bloblen = 0},
+			.type = BINDING_INTEGER,
+			.value = {.integer = from},
 		}, {
 			.type = BINDING_INTEGER,
 			.value = {.integer = id},
 		}
 	};
-	const char *sql = "UPDATE documents SET data = ? WHERE id = ?;";
-	FILE *fp;
-	int datalen;
+	const char *sql =
+		"UPDATE documents SET (bid, size) = ("
+			"SELECT bid, size FROM documents WHERE id = ?"
+		") WHERE id = ?;";
+	sqlite3_int64 oldbid;
+	sqlite3_int64 bid;
 
-	fp = ks_openfile(filename, &datalen);
-	if (datalen == 0)
-		b[0].type = BINDING_NULL;
-	else
-		b[0].value.bloblen = datalen;
+	oldbid = ks_getbid(db, id);
+	bid = ks_getbid(db, from);
+	if (bid > 0)
+		ks_refblob(db, bid, 1);
 
 	ks_sql(db, sql, b, 2, NULL, NULL);
 
-	if (fp != NULL)
-		ks_writeblob(db, id, fp);
+	if (oldbid > 0)
+		ks_dropblob(db, oldbid);
 }
 
-static void ks_mod(const struct config *cfg)
+static void ks_moddocument(sqlite3 *db, const struct config *cfg,
+		sqlite3_int64 id, sqlite3_int64 first)
 {
-	sqlite3 *db;
 	struct tag *t;
+	int reindex;
 
-	if (cfg->id < 0)
-		ks_errx("mod command requires an id");
+	reindex = (cfg->title != NULL || cfg->file != NULL);
 
-	db = ks_open(cfg->database);
-	ks_begin(db);
+	if (reindex)
+		ks_indexdocument(db, id, 1);
 
 	if (cfg->category != NULL)
-		ks_setcategory(db, cfg->id, cfg->category);
+		ks_setcategory(db, id, cfg->category);
 
 	if (cfg->title != NULL)
-		ks_settitle(db, cfg->id, cfg->title);
+		ks_settitle(db, id, cfg->title);
 
-	if (cfg->file != NULL)
-		ks_setfile(db, cfg->id, cfg->file);
+	if (cfg->file != NULL && id == first)
+		ks_setfile(db, id, cfg->file, cfg->compress);
+	else if (cfg->file != NULL)
+		ks_sharedata(db, id, first);
 
 	for (t = cfg->tags; t != NULL; t = t->next)
-		ks_inserttag(db, cfg->id, t->label);
+		ks_inserttag(db, id, t->label);
+
+	if (reindex)
+		ks_indexdocument(db, id, 0);
+}
+
+static void ks_mod(const struct config *cfg)
+{
+	struct idlist l = {.ids = NULL, .n = 0, .cap = 0};
+	sqlite3 *db;
+	size_t i;
+
+	if (cfg->ids == NULL)
+		ks_errx("mod command requires an id");
+
+	db = ks_open(cfg->database);
+	ks_begin(db);
+
+	ks_selectids(db, cfg, &l, 1);
+	for (i = 0; i < l.n; i++)
+		ks_moddocument(db, cfg, l.ids[i], l.ids[0]);
 
 	ks_end(db);
 }
 
-static void ks_rm(const struct config *cfg)
+static void ks_rmdocument(sqlite3 *db, sqlite3_int64 id)
 {
 	struct binding b = {
 		.type = BINDING_INTEGER,
-		.value = {.integer = cfg->id}
+		.value = {.integer = id}
 	};
 	const char *sql = "DELETE FROM documents WHERE id = ?;";
+	sqlite3_int64 bid;
+
+	bid = ks_getbid(db, id);
+	if (bid >= 0)
+		ks_indexdocument(db, id, 1);
+	ks_sql(db, sql, &b, 1, NULL, NULL);
+	if (bid > 0)
+		ks_dropblob(db, bid);
+}
+
+static void ks_rm(const struct config *cfg)
+{
+	struct idlist l = {.ids = NULL, .n = 0, .cap = 0};
 	sqlite3 *db;
+	size_t i;
 
-	if (cfg->id < 0)
+	if (cfg->ids == NULL)
 		ks_errx("id required for rm command");
 
 	db = ks_open(cfg->database);
+	ks_begin(db);
 
-	ks_sql(db, sql, &b, 1, NULL, NULL);
+	ks_selectids(db, cfg, &l, 0);
+	for (i = 0; i < l.n; i++)
+		ks_rmdocument(db, l.ids[i]);
+
+	ks_end(db);
 }
 
-struct table {
-	struct row *rows;
+static sqlite3_int64 ks_dbsize(sqlite3 *db)
+{
+	sqlite3_int64 pages = 0;
+	sqlite3_int64 pagesize = 0;
+
+	ks_sql(db, "PRAGMA page_count;", NULL, 0, ks_storeint, &pages);
+	ks_sql(db, "PRAGMA page_size;", NULL, 0, ks_storeint, &pagesize);
+	return pages * pagesize;
+}
+
+static sqlite3_int64 ks_purge(sqlite3 *db, const char *sql)
+{
+	ks_sql(db, sql, NULL, 0, NULL, NULL);
+	return sqlite3_changes(db);
+}
+
+static sqlite3_int64 ks_packsize(sqlite3 *db)
+{
+	const char *sql = "SELECT ifnull(sum(size), 0) FROM packs;";
+	sqlite3_int64 size = 0;
+
+	ks_sql(db, sql, NULL, 0, ks_storeint, &size);
+	return size;
+}
+
+/*
+ * Packs only ever grow, so the blobs still alive in a pack that is mostly dead
+ * are copied, in the order they were written, to the end of a fresh pack. The
+ * old packs' rows go with the transaction; their files once it commits.
+ */
+struct move {
+	sqlite3_int64 bid;
+	struct location loc;
+};
+
+struct movelist {
+	struct move *moves;
+	size_t n;
+	size_t cap;
+};
+
+struct copy {
+	struct packfile *pf;
+	sqlite3_int64 offset;
+};
+
+static void ks_storemove(sqlite3 *db, sqlite3_stmt *stmt, void *arg)
+{
+	struct movelist *l = arg;
+	struct move *mv;
+
+	(void)db;
+
+	if (l->n == l->cap) {
+		l->cap = (l->cap == 0) ? 64 : l->cap * 2;
+		mv = ks_alloc(&m.arena, l->cap * sizeof(*mv));
+		if (l->n > 0)
+			memcpy(mv, l->moves, l->n * sizeof(*mv));
+		l->moves = mv;
+	}
+
+	mv = &l->moves[l->n++];
+	mv->bid = sqlite3_column_int64(stmt, 0);
+	mv->loc.pack = sqlite3_column_int64(stmt, 1);
+	mv->loc.offset = sqlite3_column_int64(stmt, 2);
+	mv->loc.length = sqlite3_column_int64(stmt, 3);
+}
+
+static void ks_copydata(const void *data, size_t len, void *arg)
+{
+	struct copy *c = arg;
+
+	ks_packwrite(c->pf, data, len, c->offset);
+	c->offset += (sqlite3_int64)len;
+}
+
+static void ks_compact(sqlite3 *db, struct idlist *victims)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = 0},
+	};
+	const char *victimsql =
+		"SELECT pack FROM packs "
+		"WHERE dead > 0 AND dead * " MAKESTR(PACKDEAD) " >= size "
+		"ORDER BY pack;";
+	const char *blobsql =
+		"SELECT bid, pack, offset, length FROM blobs "
+		"WHERE pack IS NOT NULL AND pack = ? ORDER BY offset;";
+	const char *dropsql = "DELETE FROM packs WHERE pack = ?;";
+	struct movelist l = {.moves = NULL, .n = 0, .cap = 0};
+	struct location dst;
+	struct copy c;
+	size_t i;
+
+	ks_sql(db, victimsql, NULL, 0, ks_storeid, victims);
+	if (victims->n == 0)
+		return;
+
+	for (i = 0; i < victims->n; i++) {
+		b.value.integer = victims->ids[i];
+		ks_sql(db, blobsql, &b, 1, ks_storemove, &l);
+	}
+
+	dst.pack = ks_newpack(db);
+	dst.offset = 0;
+	for (i = 0; i < l.n; i++) {
+		if (dst.offset >= PACKSIZE) {
+			dst.pack = ks_newpack(db);
+			dst.offset = 0;
+		}
+
+		c.pf = ks_packfile(dst.pack, 1);
+		c.offset = dst.offset;
+		ks_readpack(&l.moves[i].loc, 0, l.moves[i].loc.length,
+				ks_copydata, &c);
+
+		dst.length = l.moves[i].loc.length;
+		ks_setlocation(db, l.moves[i].bid, &dst);
+		dst.offset = c.offset;
+		ks_setpacksize(db, dst.pack, dst.offset);
+	}
+
+	for (i = 0; i < victims->n; i++) {
+		b.value.integer = victims->ids[i];
+		ks_sql(db, dropsql, &b, 1, NULL, NULL);
+	}
+}
+
+/*
+ * Remove the pack files that no pack refers to: those compacted away while a
+ * reader might still have needed them, and those left by writes that never
+ * committed. Holding the write lock keeps writers from creating any meanwhile.
+ */
+static void ks_sweeppacks(sqlite3 *db)
+{
+	struct binding b = {
+		.type = BINDING_INTEGER,
+		.value = {.integer = 0},
+	};
+	const char *sql = "SELECT count(*) FROM packs WHERE pack = ?;";
+	const char *base = strrchr(m.path, '/') + 1;
+	const char *name;
+	size_t len = strlen(base);
+	struct dirent *de;
+	sqlite3_int64 n;
+	char *end;
+	DIR *dir;
+
+	dir = opendir(ks_packdir());
+	if (dir == NULL)
+		ks_err("opendir(%s)", ks_packdir());
+
+	ks_begin(db);
+	while ((de = readdir(dir)) != NULL) {
+		name = de->d_name;
+		if (strncmp(name, base, len) != 0 || name[len] != '.'
+				|| name[len + 1] < '0' || name[len + 1] > '9')
+			continue;
+
+		b.value.integer = strtoll(name + len + 1, &end, 10);
+		if (strcmp(end, ".pack") != 0)
+			continue;
+
+		n = 1;
+		ks_sql(db, sql, &b, 1, ks_storeint, &n);
+		name = ks_sprintf("%s/%s", ks_packdir(), name);
+		if (n == 0 && unlink(name) < 0 && errno != ENOENT)
+			ks_err("unlink(%s)", name);
+	}
+	closedir(dir);
+	ks_end(db);
+}
+
+/*
+ * Delete whatever no document refers to any more, compact packs that are
+ * mostly dead, then hand the free pages back to the filesystem. Documents, and
+ * so the search index, are left alone. Libraries created before auto_vacuum
+ * was set are converted by a full VACUUM the first time; after that only the
+ * free pages are moved.
+ */
+static void ks_gc(const struct config *cfg)
+{
+	struct idlist victims = {.ids = NULL, .n = 0, .cap = 0};
+	sqlite3_int64 before;
+	sqlite3_int64 autovacuum = 0;
+	sqlite3_int64 busy = 1;
+	sqlite3_int64 doctags;
+	sqlite3_int64 tags;
+	sqlite3_int64 categories;
+	sqlite3_int64 blobs;
+	sqlite3 *db;
+	int rc;
+
+	db = ks_open(cfg->database);
+	before = ks_dbsize(db) + ks_packsize(db);
+
+	ks_begin(db);
+	doctags = ks_purge(db, "DELETE FROM doctag "
+			"WHERE id NOT IN (SELECT id FROM documents);");
+	tags = ks_purge(db, "DELETE FROM tags "
+			"WHERE tid NOT IN (SELECT tid FROM doctag);");
+	categories = ks_purge(db, "DELETE FROM categories "
+			"WHERE cid NOT IN ("
+				"SELECT cid FROM documents "
+				"WHERE cid IS NOT NULL"
+			");");
+	ks_purge(db, "UPDATE packs SET dead = dead + ("
+				"SELECT ifnull(sum(length), 0) FROM blobs "
+				"WHERE pack = packs.pack AND bid NOT IN ("
+					"SELECT bid FROM documents "
+					"WHERE bid IS NOT NULL"
+				")"
+			");");
+	ks_purge(db, "DELETE FROM chunks "
+			"WHERE bid NOT IN ("
+				"SELECT bid FROM documents "
+				"WHERE bid IS NOT NULL"
+			");");
+	blobs = ks_purge(db, "DELETE FROM blobs "
+			"WHERE bid NOT IN ("
+				"SELECT bid FROM documents "
+				"WHERE bid IS NOT NULL"
+			");");
+	ks_compact(db, &victims);
+	ks_sql(db, "INSERT INTO search (search) VALUES ('optimize');",
+			NULL, 0, NULL, NULL);
+	ks_end(db);
 
+	ks_closepacks();
+
+	ks_sql(db, "PRAGMA auto_vacuum;", NULL, 0, ks_storeint, &autovacuum);
+	if (autovacuum == 2)
+		rc = sqlite3_exec(db, "PRAGMA incremental_vacuum;",
+				NULL, NULL, NULL);
+	else
+		rc = sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;"
+				"VACUUM;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK)
+		ks_errx("vacuum failed: %s", sqlite3_errmsg(db));
+
+	/*
+	 * Shrink the write-ahead log too, so the files track the pages. Only
+	 * once that completes is no reader left on a snapshot from before the
+	 * commit, which could still be reading the compacted packs; if one is,
+	 * their files are left for a later gc.
+	 */
+	ks_sql(db, "PRAGMA wal_checkpoint(TRUNCATE);", NULL, 0, ks_storeint,
+			&busy);
+	if (busy == 0)
+		ks_sweeppacks(db);
+
+	printf("purged %lld tag links, %lld tags, %lld categories and "
+			"%lld blobs; compacted %lld packs; reclaimed %lld "
+			"bytes\n", doctags, tags, categories, blobs,
+			(long long)victims.n,
+			before - ks_dbsize(db) - ks_packsize(db));
+}
+
+struct table {
 	size_t titlewidth;
 	size_t categorywidth;
 	size_t idwidth;
 	size_t tagwidth;
 	sqlite3_int64 idcap;
+	enum format format;
 };
 
-static void ks_collecttag(sqlite3 *db, sqlite3_stmt *stmt, void *_tags)
+/* tags are fetched as one column, split by a byte no label should contain */
+#define TAGSEP '\x1f'
+
+static void ks_getwidths(sqlite3 *db, sqlite3_stmt *stmt, void *_tbl)
+{
+	struct table *tbl = _tbl;
+	sqlite3_int64 maxid;
+	size_t width;
+
+	(void)db;
+
+	maxid = sqlite3_column_int64(stmt, 0);
+	while (maxid >= tbl->idcap) {
+		tbl->idcap *= 10;
+		tbl->idwidth++;
+	}
+
+	width = (size_t)sqlite3_column_int64(stmt, 1);
+	if (width > tbl->titlewidth)
+		tbl->titlewidth = width;
+
+	width = (size_t)sqlite3_column_int64(stmt, 2);
+	if (width > tbl->categorywidth)
+		tbl->categorywidth = width;
+
+	width = (size_t)sqlite3_column_int64(stmt, 3);
+	if (width > tbl->tagwidth)
+		tbl->tagwidth = width;
+}
+
+static void ks_printheader(const struct table *tbl)
+{
+	printf("\x1b[4m%-*s  %-*s  %-*s  %-*s\n\x1b[0m",
+			(int)tbl->idwidth, "ID",
+			(int)tbl->categorywidth, "Category",
+			(int)tbl->titlewidth, "Title",
+			(int)tbl->tagwidth, "Tags");
+}
+
+/* write each tag with sep between them, through put if it is given */
+static void ks_puttags(const char *tags, int sep,
+		void (*put)(const char *, size_t))
+{
+	const char *next;
+	size_t len;
+
+	for (; tags != NULL; tags = next) {
+		next = strchr(tags, TAGSEP);
+		len = (next != NULL) ? (size_t)(next - tags) : strlen(tags);
+
+		if (put != NULL)
+			put(tags, len);
+		else
+			fwrite(tags, 1, len, stdout);
+
+		if (next != NULL) {
+			putchar(sep);
+			next++;
+		}
+	}
+}
+
+static void ks_printrow(const struct table *tbl, const struct row *r)
 {
-	struct tag **tags = _tags;
-	struct tag *t;
+	printf("%*lld  %-*s  %-*s  ", (int)tbl->idwidth, r->id,
+			(int)tbl->categorywidth, r->category,
+			(int)tbl->titlewidth, r->title);
+	if (r->tags != NULL) {
+		ks_puttags(r->tags, ' ', NULL);
+		putchar(' ');
+	}
+	putchar('\n');
+}
 
-	(void)db;
+/* TSV fields escape backslashes, tabs and line breaks with a backslash */
+static void ks_puttsv(const char *s, size_t len)
+{
+	const char *end = s + len;
+	size_t n;
+
+	while (s < end) {
+		n = strcspn(s, "\\\t\n\r");
+		if (n > (size_t)(end - s))
+			n = (size_t)(end - s);
+		fwrite(s, 1, n, stdout);
+		s += n;
+		if (s == end)
+			break;
 
-	t = ks_tag();
-	t->label = ks_strdup((const char *)sqlite3_column_text(stmt, 0));
-	t->next = *tags;
-	*tags = t;
+		switch (*s++) {
+		case '\t':
+			fputs("\\t", stdout);
+			break;
+		case '\n':
+			fputs("\\n", stdout);
+			break;
+		case '\r':
+			fputs("\\r", stdout);
+			break;
+		default:
+			fputs("\\\\", stdout);
+			break;
+		}
+	}
 }
 
-static struct tag *ks_gettags(sqlite3 *db, sqlite3_int64 id)
+static void ks_putjson(const char *s, size_t len)
 {
-	struct binding b = {
-		.type = BINDING_INTEGER,
-		.value = {.integer = id},
-	};
-	const char *sql =
-		"SELECT label "
-		"FROM doctag INNER JOIN tags "
-			"ON doctag.tid = tags.tid "
-		"WHERE id = ?;";
-	struct tag *result = NULL;
-
-	ks_sql(db, sql, &b, 1, ks_collecttag, &result);
+	const char *end = s + len;
+
+	putchar('"');
+	for (; s < end; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if (*s == '\n')
+			fputs("\\n", stdout);
+		else if (*s == '\t')
+			fputs("\\t", stdout);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
 
-	return result;
+/*
+ * Machine-readable rows aren't padded. TSV and NUL rows are tab-separated with
+ * the tags as trailing fields and escaped alike, the latter terminated by a
+ * NUL byte; JSON Lines rows are one object per line.
+ */
+static void ks_printfields(const struct row *r, int end)
+{
+	printf("%lld\t", r->id);
+	ks_puttsv(r->category, strlen(r->category));
+	putchar('\t');
+	ks_puttsv(r->title, strlen(r->title));
+	if (r->tags != NULL) {
+		putchar('\t');
+		ks_puttags(r->tags, '\t', ks_puttsv);
+	}
+	putchar(end);
 }
 
-static size_t ks_gettagwidth(struct tag *t)
+static void ks_printjson(const struct row *r)
 {
-	size_t width = 0;
-	for (; t != NULL; t = t->next)
-		width += strlen(t->label) + 1;
-	return width;
+	printf("{\"id\":%lld,\"category\":", r->id);
+	ks_putjson(r->category, strlen(r->category));
+	fputs(",\"title\":", stdout);
+	ks_putjson(r->title, strlen(r->title));
+	fputs(",\"tags\":[", stdout);
+	ks_puttags(r->tags, ',', ks_putjson);
+	fputs("]}\n", stdout);
 }
 
-static void ks_saverow(sqlite3 *db, sqlite3_stmt *stmt, void *_tbl)
+static void ks_streamrow(sqlite3 *db, sqlite3_stmt *stmt, void *_tbl)
 {
-	struct table *tbl = _tbl;
-	struct row *r;
-	const char *title;
-	const char *category;
-	size_t tagwidth;
-	sqlite3_int64 id;
+	const struct table *tbl = _tbl;
+	struct row r;
 
-	id = sqlite3_column_int64(stmt, 0);
-	title = (void *)sqlite3_column_text(stmt, 1);
-	category = (void *)sqlite3_column_text(stmt, 2);
+	(void)db;
 
-	if (id >= tbl->idcap) {
-		tbl->idcap *= 10;
-		tbl->idwidth++;
-	}
+	r.id = sqlite3_column_int64(stmt, 0);
+	r.title = (void *)sqlite3_column_text(stmt, 1);
+	r.category = (void *)sqlite3_column_text(stmt, 2);
+	r.tags = (void *)sqlite3_column_text(stmt, 3);
 
-	if (strlen(title) > tbl->titlewidth)
-		tbl->titlewidth = strlen(title);
+	switch (tbl->format) {
+	case FORMAT_JSONL:
+		ks_printjson(&r);
+		break;
+	case FORMAT_NUL:
+		ks_printfields(&r, '\0');
+		break;
+	case FORMAT_TSV:
+		ks_printfields(&r, '\n');
+		break;
+	case FORMAT_TABLE:
+	default:
+		ks_printrow(tbl, &r);
+	}
+}
 
-	if (strlen(category) > tbl->categorywidth)
-		tbl->categorywidth = strlen(category);
+/*
+ * Every show query fetches the document metadata together with all of its tags
+ * in a single pass; the tags are collapsed into one space-separated column so
+ * there is no per-row query for them. Rows are printed as they are stepped,
+ * so the column widths are found beforehand by an aggregate over the same
+ * filter (measured in bytes, as ks_printrow pads them).
+ */
+#define SHOW_FROM \
+	"FROM documents INNER JOIN categories " \
+		"ON documents.cid = categories.cid "
+#define SHOW_SELECT \
+	"SELECT documents.id, title, cname, group_concat(label, char(31)) " \
+	SHOW_FROM \
+	"LEFT JOIN doctag ON documents.id = doctag.id " \
+	"LEFT JOIN tags ON doctag.tid = tags.tid "
+#define SHOW_GROUP "GROUP BY documents.id ORDER BY documents.id DESC;"
+#define SHOW_WIDTHS \
+	"SELECT max(documents.id), " \
+		"max(length(CAST(title AS BLOB))), " \
+		"max(length(CAST(cname AS BLOB))), " \
+		"max((" \
+			"SELECT sum(length(CAST(label AS BLOB)) + 1) " \
+			"FROM doctag INNER JOIN tags " \
+				"ON doctag.tid = tags.tid " \
+			"WHERE doctag.id = documents.id" \
+		")) " \
+	SHOW_FROM
+
+/*
+ * Category and tag filters match exactly unless they contain a glob
+ * character, in which case they are matched with GLOB. Both forms are
+ * case-sensitive, so a literal prefix such as "data*" is still answered with
+ * a range scan over the name index.
+ */
+static const char *ks_match(const char *pattern)
+{
+	if (strpbrk(pattern, "*?[") != NULL)
+		return "GLOB ?";
+	return "= ?";
+}
 
-	r = ks_row();
-	r->next = tbl->rows;
-	r->title = ks_strdup(title);
-	r->category = ks_strdup(category);
-	r->id = id;
-	r->tags = ks_gettags(db, id);
-	tbl->rows = r;
+struct filter {
+	const char *where;
+	struct binding *b;
+	int nbindings;
+};
 
-	tagwidth = ks_gettagwidth(r->tags);
-	if (tagwidth > tbl->tagwidth)
-		tbl->tagwidth = tagwidth;
+static void ks_filterclause(struct filter *f, const char *clause)
+{
+	if (f->where == NULL)
+		f->where = clause;
+	else
+		f->where = ks_sprintf("%s AND %s", f->where, clause);
 }
 
-static void ks_printheader(const struct table *tbl)
+static void ks_filtertext(struct filter *f, const char *text)
 {
-	size_t i;
+	struct binding *b = &f->b[f->nbindings++];
 
-	printf("\x1b[4mID  ");
-	for (i = 2; i < tbl->idwidth; i++)
-		printf(" ");
-	printf("Category  ");
-	for (i = strlen("Category"); i < tbl->categorywidth; i++)
-		printf(" ");
-	printf("Title  ");
-	for (i = strlen("Title"); i < tbl->titlewidth; i++)
-		printf(" ");
-	printf("Tags");
-	for (i = strlen("Tags"); i < tbl->tagwidth; i++)
-		printf(" ");
-	printf("\n\x1b[0m");
+	b->type = BINDING_TEXT;
+	b->value.text = text;
 }
 
-static void ks_printrow(const struct table *tbl, const struct row *r)
+/*
+ * Each tag term becomes one indexed subquery over doctag: the document must
+ * (or, for an excluded tag, must not) carry any of the comma-separated
+ * alternatives in the term. Terms are combined with AND, so the whole tag
+ * expression is answered by the single show query.
+ */
+static void ks_filtertag(struct filter *f, const struct tag *t)
 {
-	size_t i;
-	sqlite3_int64 cap;
-	struct tag *t;
+	const char *match = NULL;
+	char *label;
+	char *next;
+
+	for (label = ks_strdup(t->label); label != NULL; label = next) {
+		next = strchr(label, ',');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (match == NULL)
+			match = ks_sprintf("label %s", ks_match(label));
+		else
+			match = ks_sprintf("%s OR label %s", match,
+					ks_match(label));
+		ks_filtertext(f, label);
+	}
 
-	for (cap = tbl->idcap / 10; r->id < cap; cap /= 10)
-		printf(" ");
-	printf("%lld  ", r->id);
-	printf("%s  ", r->category);
-	for (i = strlen(r->category); i < tbl->categorywidth; i++)
-		printf(" ");
-	printf("%s  ", r->title);
-	for (i = strlen(r->title); i < tbl->titlewidth; i++)
-		printf(" ");
-	for (t = r->tags; t != NULL; t = t->next)
-		printf("%s ", t->label);
-	printf("\n");
+	ks_filterclause(f, ks_sprintf(
+		"documents.id %sIN ("
+			"SELECT doctag.id "
+			"FROM doctag INNER JOIN tags "
+				"ON doctag.tid = tags.tid "
+			"WHERE %s"
+		")",
+		t->exclude ? "NOT " : "", match));
 }
 
-static void ks_showtags(const struct config *cfg, struct table *tbl)
+static void ks_filternames(struct filter *f, const struct config *cfg)
 {
-	struct binding b[] = {
-		{
-			.type = BINDING_TEXT,
-			.value = {.text = cfg->category}
-		}, {
-			.type = BINDING_TEXT,
-			.value = {.text = cfg->tags->label}
-		}
-	};
-	sqlite3 *db;
-	const char *sql =
-		"SELECT documents.id, title, cname "
-		"FROM documents JOIN categories "
-			"ON documents.cid = categories.cid "
-		"JOIN doctag ON documents.id = doctag.id "
-		"JOIN tags ON doctag.tid = tags.tid "
-		"WHERE cname LIKE ? AND label LIKE ?;";
+	const struct tag *t;
 
-	if (cfg->category == NULL)
-		b[0].value.text = "%";
-
-	if (cfg->tags->next != NULL)
-		ks_errx("can only filter on a single tag");
+	if (cfg->category != NULL) {
+		ks_filterclause(f, ks_sprintf("cname %s",
+				ks_match(cfg->category)));
+		ks_filtertext(f, cfg->category);
+	}
 
-	db = ks_open(cfg->database);
-	ks_sql(db, sql, b, 2, ks_saverow, tbl);
+	for (t = cfg->tags; t != NULL; t = t->next)
+		ks_filtertag(f, t);
 }
 
-static void ks_showcategory(const struct config *cfg, struct table *tbl)
+static void ks_filterids(struct filter *f, const struct config *cfg)
 {
-	struct binding b = {
-		.type = BINDING_TEXT,
-		.value = {.text = cfg->category}
-	};
-	sqlite3 *db;
-	const char *sql =
-		"SELECT id, title, cname "
-		"FROM documents INNER JOIN categories "
-			"ON documents.cid = categories.cid "
-		"WHERE cname LIKE ?;";
-
-	if (cfg->category == NULL)
-		b.value.text = "%";
+	const struct idrange *r;
+	const char *match = NULL;
+
+	for (r = cfg->ids; r != NULL; r = r->next) {
+		if (match == NULL)
+			match = "documents.id BETWEEN ? AND ?";
+		else
+			match = ks_sprintf("%s OR documents.id BETWEEN ? AND ?",
+					match);
+
+		f->b[f->nbindings].type = BINDING_INTEGER;
+		f->b[f->nbindings++].value.integer = r->first;
+		f->b[f->nbindings].type = BINDING_INTEGER;
+		f->b[f->nbindings++].value.integer = r->last;
+	}
 
-	db = ks_open(cfg->database);
-	ks_sql(db, sql, &b, 1, ks_saverow, tbl);
+	ks_filterclause(f, ks_sprintf("(%s)", match));
 }
 
-static void ks_showid(const struct config *cfg, struct table *tbl)
+static int ks_countbindings(const struct config *cfg)
 {
-	struct binding b = {
-		.type = BINDING_INTEGER,
-		.value = {.integer = cfg->id}
-	};
-	sqlite3 *db;
-	const char *sql =
-		"SELECT id, title, cname "
-		"FROM documents INNER JOIN categories "
-			"ON documents.cid = categories.cid "
-		"WHERE id = ?;";
+	const struct idrange *r;
+	const struct tag *t;
+	const char *c;
+	int n = 1;
+
+	for (r = cfg->ids; r != NULL; r = r->next)
+		n += 2;
+
+	for (t = cfg->tags; t != NULL; t = t->next) {
+		n++;
+		for (c = strchr(t->label, ','); c != NULL;
+				c = strchr(c + 1, ','))
+			n++;
+	}
 
-	db = ks_open(cfg->database);
-	ks_sql(db, sql, &b, 1, ks_saverow, tbl);
+	return n;
 }
 
-static void ks_show(const struct config *cfg)
+/*
+ * Print the rows of a show query, in the table layout after a pass to find
+ * the column widths, or as they are stepped in the machine-readable formats.
+ */
+static void ks_list(const struct config *cfg, const char *sql,
+		const char *widthsql, const struct filter *f)
 {
 	struct table tbl = {
-		.rows = NULL,
 		.idwidth = 2,
 		.idcap = 100,
 		.titlewidth = strlen("Title"),
 		.categorywidth = strlen("Category"),
 		.tagwidth = strlen("Tags"),
+		.format = cfg->format,
+	};
+	sqlite3 *db;
+
+	db = ks_open(cfg->database);
+
+	if (cfg->format == FORMAT_TABLE) {
+		ks_sql(db, widthsql, f->b, f->nbindings, ks_getwidths, &tbl);
+		if (!cfg->noheader)
+			ks_printheader(&tbl);
+	} else if (cfg->format == FORMAT_TSV && !cfg->noheader) {
+		printf("id\tcategory\ttitle\ttags\n");
+	}
+
+	ks_sql(db, sql, f->b, f->nbindings, ks_streamrow, &tbl);
+}
+
+static void ks_show(const struct config *cfg)
+{
+	struct filter f = {
+		.where = NULL,
+		.b = NULL,
+		.nbindings = 0,
 	};
-	struct row *r;
+	const char *sql;
+	const char *widthsql;
+
+	f.b = ks_alloc(&m.arena, (size_t)ks_countbindings(cfg) * sizeof(*f.b));
 
-	if (cfg->id >= 0)
-		ks_showid(cfg, &tbl);
-	else if (cfg->tags != NULL)
-		ks_showtags(cfg, &tbl);
+	if (cfg->ids != NULL)
+		ks_filterids(&f, cfg);
 	else
-		ks_showcategory(cfg, &tbl);
+		ks_filternames(&f, cfg);
+
+	if (f.where == NULL) {
+		sql = SHOW_SELECT SHOW_GROUP;
+		widthsql = SHOW_WIDTHS ";";
+	} else {
+		sql = ks_sprintf("%sWHERE %s %s", SHOW_SELECT, f.where,
+				SHOW_GROUP);
+		widthsql = ks_sprintf("%sWHERE %s;", SHOW_WIDTHS, f.where);
+	}
+
+	ks_list(cfg, sql, widthsql, &f);
+}
+
+/*
+ * Search results are the documents matching the full-text query, best (lowest
+ * bm25 rank) first, and may be narrowed by the same category and tag filters
+ * as show.
+ */
+#define SEARCH_HITS \
+	"INNER JOIN (" \
+		"SELECT rowid, rank FROM search WHERE search MATCH ?" \
+	") AS hits ON hits.rowid = documents.id "
+#define SEARCH_GROUP \
+	"GROUP BY documents.id ORDER BY hits.rank, documents.id DESC;"
+
+static void ks_search(const struct config *cfg)
+{
+	struct filter f = {
+		.where = NULL,
+		.b = NULL,
+		.nbindings = 0,
+	};
+	const char *sql;
+	const char *widthsql;
+
+	if (cfg->query == NULL)
+		ks_errx("search command requires a query");
+
+	f.b = ks_alloc(&m.arena,
+			(size_t)(ks_countbindings(cfg) + 1) * sizeof(*f.b));
+
+	ks_filtertext(&f, cfg->query);
+	ks_filternames(&f, cfg);
+
+	if (f.where == NULL) {
+		sql = SHOW_SELECT SEARCH_HITS SEARCH_GROUP;
+		widthsql = SHOW_WIDTHS SEARCH_HITS ";";
+	} else {
+		sql = ks_sprintf("%s%sWHERE %s %s", SHOW_SELECT, SEARCH_HITS,
+				f.where, SEARCH_GROUP);
+		widthsql = ks_sprintf("%s%sWHERE %s;", SHOW_WIDTHS,
+				SEARCH_HITS, f.where);
+	}
 
-	if (!cfg->noheader)
-		ks_printheader(&tbl);
-	for (r = tbl.rows; r != NULL; r = r->next)
-		ks_printrow(&tbl, r);
+	ks_list(cfg, sql, widthsql, &f);
 }
 
 static char *ks_home(const char *name)
 {
 	const char *home;
-	char *result;
-	size_t len;
-	int rc;
 
 	home = getenv("HOME");
 	if (home == NULL)
 		ks_errx("can't find HOME directory?");
 
-	rc = snprintf(NULL, 0, "%s/%s", home, name);
-	if (rc < 0)
-		ks_errx("can't compute default database name");
-	len = (size_t)rc;
-
-	result = ks_stralloc(len);
-	snprintf(result, len + 1, "%s/%s", home, name);
-
-	return result;
+	return ks_sprintf("%s/%s", home, name);
 }
 
 static void ks_cleanup(void)
 {
-	struct dynstr *s, *n;
-	struct stmt *stmt, *nstmt;
-	struct row *r, *nr;
-	struct tag *t, *nt;
-
-	for (t = m.tags; t != NULL; t = nt) {
-		nt = t->mnext;
-		free(t);
-	}
-
-	for (r = m.rows; r != NULL; r = nr) {
-		nr = r->mnext;
-		free(r);
-	}
-
-	for (s = m.s; s != NULL; s = n) {
-		n = s->next;
-		free(s);
-	}
+	struct stmt *stmt;
 
-	for (stmt = m.stmts; stmt != NULL; stmt = nstmt) {
-		nstmt = stmt->next;
-		if (stmt->stmt != NULL)
-			sqlite3_finalize(stmt->stmt);
-		free(stmt);
-	}
+	for (stmt = m.stmts; stmt != NULL; stmt = stmt->next)
+		sqlite3_finalize(stmt->stmt);
+	ks_closeblob();
+	ks_closepacks();
 
 	if (m.db != NULL)
 		sqlite3_close(m.db);
+
+	ks_free(&m.arena);
+	ks_free(&m.cache);
 }
 
 static void ks_help(void)
 {
-	printf("usage: ks [-d | --database <path>] <command> [<args>]\n\n");
+	printf("usage: ks [-d | --database <path>] [--stats] [--trace] "
+			"<command> [<args>]\n\n");
 	printf("commands:\n");
 	printf("  add\t\tadd a new document to the database\n");
 	printf("  cat\t\tread the file contents of a document in the database\n");
 	printf("  categories\tlist all categories in the database\n");
+	printf("  complete\tlist ids, categories and tags for completion\n");
+	printf("  gc\t\tpurge unused data and shrink the database\n");
 	printf("  help\t\tprint this usage message\n");
+	printf("  import\tadd many documents listed in a manifest\n");
 	printf("  init\t\tcreate a new document database\n");
+	printf("  migrate\tupgrade a database to the current schema\n");
 	printf("  mod\t\tmodify an existing document's metadata\n");
 	printf("  rm\t\tremove a document from the database\n");
+	printf("  search\tfind documents by the words in them\n");
+	printf("  serve\t\tanswer other commands from a running server\n");
 	printf("  show\t\tprint document metadata from the database\n");
 	printf("  tags\t\tlist all tags in the library\n");
 	printf("  version\tprint the cli tool's version\n");
@@ -945,12 +3814,11 @@ static void ks_help(void)
 
 static void ks_dbversion(const struct config *cfg)
 {
-	const char *sql = "SELECT v FROM version;";
 	sqlite3 *db;
 	sqlite3_int64 v;
 
-	db = ks_open(cfg->database);
-	ks_sql(db, sql, NULL, 0, ks_storeint, &v);
+	db = ks_opendb(cfg->database);
+	v = ks_getversion(db);
 	printf("ks database version %lld\n", v);
 }
 
@@ -972,55 +3840,630 @@ static void ks_version(const struct config *cfg)
 				VERSION_MINOR, VERSION_PATCH);
 }
 
-int main(int argc, const char *argv[])
+static void ks_defaults(struct config *cfg)
 {
-	struct config cfg = {
+	struct config defaults = {
+		.batch = 1000,
+		.compress = 0,
 		.category = NULL,
 		.cmd  = CMD_NONE,
 		.database = ks_home(".ksdb"),
 		.dbversion = 0,
 		.file = NULL,
-		.id = -1,
+		.format = FORMAT_TABLE,
+		.framed = 0,
+		.ids = NULL,
+		.jobs = 0,
 		.noheader = 0,
+		.nul = 0,
+		.packs = 0,
+		.query = NULL,
+		.ranges = NULL,
+		.stats = 0,
 		.tags = NULL,
 		.title = NULL,
+		.trace = 0,
 	};
-	atexit(ks_cleanup);
 
-	cli_parse(argc, argv, &cfg);
+	*cfg = defaults;
+}
+
+static void ks_startstats(const struct config *cfg)
+{
+	memset(&st, 0, sizeof(st));
+	st.enabled = cfg->stats;
+	st.trace = cfg->trace;
+	st.start = ks_clock();
+	sqlite3_memory_highwater(1);
+
+	/* a server's connection is already open */
+	if (m.db != NULL)
+		ks_settrace(m.db);
+}
+
+/*
+ * A server's resident peak covers its whole lifetime rather than the request,
+ * so it is labelled as such.
+ */
+static void ks_printstats(int served)
+{
+	struct rusage ru;
+	double total;
+
+	if (!st.enabled)
+		return;
+
+	/* output still sitting in stdio's buffer is part of the command */
+	fflush(stdout);
+	total = ks_clock() - st.start;
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(stderr, "stats: open     %10.6f s\n", st.open);
+	fprintf(stderr, "stats: prepare  %10.6f s  %lld prepared, "
+			"%lld cached\n", st.prepare, st.prepared, st.cached);
+	fprintf(stderr, "stats: step     %10.6f s  %lld steps, %lld rows\n",
+			st.step, st.steps, st.nrows);
+	fprintf(stderr, "stats: rows     %10.6f s\n", st.rows);
+	fprintf(stderr, "stats: total    %10.6f s\n", total);
+	fprintf(stderr, "stats: blobs    %lld bytes read, %lld bytes written\n",
+			st.bytesread, st.byteswritten);
+	fprintf(stderr, "stats: memory   %lld bytes in sqlite, "
+			"%ld KiB resident%s\n",
+			(long long)sqlite3_memory_highwater(0), ru.ru_maxrss,
+			served ? " at the server's peak" : "");
+}
+
+static void ks_command(const struct config *cfg);
+
+/*
+ * ks serve keeps the library open, with its statements prepared and its pages
+ * cached, and runs other ks processes' commands for them. A client connects to
+ * the socket beside the database and sends a request header along with its
+ * stdin, stdout and stderr (as SCM_RIGHTS), then its working directory and
+ * arguments as NUL-terminated strings. The server runs the command on those
+ * descriptors from that directory, so output such as cat's goes to the
+ * client's stdout, and replies with the command's exit status. Commands
+ * that manage the database itself, or run long enough not to care about
+ * startup, always run in the client.
+ */
+#define SERVE_VERSION 1
+#define SERVE_MAXLEN 1048576
+#define SERVE_TIMEOUT 5
+
+struct request {
+	uint32_t version;
+	uint32_t argc;
+	uint32_t len;
+};
+
+union fdmsg {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(3 * sizeof(int))];
+};
+
+/*
+ * A command's output goes through a pipe that a thread drains into the
+ * client's stdout. When the client stops reading for SERVE_TIMEOUT seconds the
+ * thread closes the pipe, failing the command's writes, so a stalled reader
+ * can't keep the server (and the transaction of the command it runs) waiting.
+ */
+struct pump {
+	pthread_t thread;
+	int in;
+	int out;
+	int running;
+	int stalled;
+};
+
+struct server {
+	const char *database;
+	struct pump pump;
+	int stdio[3];
+	int cwd;
+};
+
+static volatile sig_atomic_t ks_stopping;
+
+/*
+ * Requests are handled one at a time inside a write transaction, so a command
+ * whose data comes from a pipe or terminal (such as 'add -f /dev/stdin') runs
+ * in the client rather than making every other client wait on it.
+ */
+static int ks_served(const struct config *cfg)
+{
+	struct stat sb;
+
+	if (cfg->file != NULL
+			&& (stat(cfg->file, &sb) < 0 || !S_ISREG(sb.st_mode)))
+		return 0;
+
+	switch (cfg->cmd) {
+	case CMD_ADD:
+	case CMD_CAT:
+	case CMD_CATEGORIES:
+	case CMD_COMPLETE:
+	case CMD_MOD:
+	case CMD_RM:
+	case CMD_SEARCH:
+	case CMD_SHOW:
+	case CMD_TAGS:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int ks_sockaddr(struct sockaddr_un *sun, const char *database)
+{
+	const char *path = ks_sprintf("%s.sock", database);
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path))
+		return -1;
+	strcpy(sun->sun_path, path);
+
+	return 0;
+}
+
+/* run the command in a server if one is listening; returns if there is none */
+static void ks_client(const struct config *cfg, int argc, const char *argv[])
+{
+	struct sockaddr_un sun;
+	struct request req = {
+		.version = SERVE_VERSION,
+		.argc = (uint32_t)argc,
+		.len = 0,
+	};
+	struct iovec iov = {
+		.iov_base = &req,
+		.iov_len = sizeof(req),
+	};
+	struct msghdr msg;
+	union fdmsg ctl;
+	struct cmsghdr *c;
+	char cwd[PATH_MAX];
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	int32_t status;
+	int sock;
+	int i;
+
+	if (ks_sockaddr(&sun, cfg->database) < 0
+			|| getcwd(cwd, sizeof(cwd)) == NULL)
+		return;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return;
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(sock);
+		return;
+	}
+
+	req.len = (uint32_t)strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		req.len += (uint32_t)strlen(argv[i]) + 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+	if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof(req))
+		ks_err("sendmsg");
+	ks_writefull(sock, cwd, strlen(cwd) + 1);
+	for (i = 0; i < argc; i++)
+		ks_writefull(sock, argv[i], strlen(argv[i]) + 1);
+
+	if (ks_readfull(sock, (char *)&status, sizeof(status))
+			!= sizeof(status))
+		ks_errx("server closed the connection");
+
+	if (status < 0) {
+		signal(-status, SIG_DFL);
+		raise(-status);
+	}
+	exit(status);
+}
+
+/* returns 0 once all of buf is written, or -1 if the client isn't reading */
+static int ks_pumpwrite(struct pump *p, const char *buf, size_t len)
+{
+	struct pollfd pfd = {
+		.fd = p->out,
+		.events = POLLOUT,
+		.revents = 0,
+	};
+	ssize_t n;
+	int rc;
+
+	while (len > 0) {
+		rc = poll(&pfd, 1, SERVE_TIMEOUT * 1000);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		else if (rc == 0)
+			p->stalled = 1;
+		if (rc <= 0)
+			return -1;
+
+		n = write(p->out, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+static void *ks_pump(void *arg)
+{
+	struct pump *p = arg;
+	char buf[PIPE_BUF];
+	ssize_t n;
+
+	for (;;) {
+		n = read(p->in, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || ks_pumpwrite(p, buf, (size_t)n) < 0)
+			break;
+	}
+
+	close(p->in);
+	return NULL;
+}
+
+static void ks_startpump(struct pump *p, int out)
+{
+	int fds[2];
+	int rc;
+
+	p->out = out;
+	p->stalled = 0;
+	if (pipe(fds) < 0)
+		ks_err("pipe");
+	p->in = fds[0];
+	dup2(fds[1], STDOUT_FILENO);
+	close(fds[1]);
+
+	rc = pthread_create(&p->thread, NULL, ks_pump, p);
+	if (rc != 0) {
+		errno = rc;
+		ks_err("pthread_create");
+	}
+	p->running = 1;
+}
 
-	switch (cfg.cmd) {
+/* once stdout no longer writes to the pipe, wait for the pump to empty it */
+static int ks_stoppump(struct pump *p)
+{
+	if (!p->running)
+		return 0;
+
+	pthread_join(p->thread, NULL);
+	close(p->out);
+	p->running = 0;
+
+	return p->stalled;
+}
+
+/*
+ * Take a request's descriptors as stdin, stdout and stderr and run its command.
+ * Anything that goes wrong from then on is reported to the client.
+ */
+static int ks_handle(struct server *srv, int sock)
+{
+	struct request req;
+	struct iovec iov = {
+		.iov_base = &req,
+		.iov_len = sizeof(req),
+	};
+	struct msghdr msg;
+	union fdmsg ctl;
+	struct cmsghdr *c;
+	struct config cfg;
+	const char **argv;
+	char *buf;
+	char *p;
+	int fds[3];
+	uint32_t i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	if (recvmsg(sock, &msg, 0) != (ssize_t)sizeof(req))
+		return EXIT_FAILURE;
+	c = CMSG_FIRSTHDR(&msg);
+	if (c == NULL || c->cmsg_level != SOL_SOCKET
+			|| c->cmsg_type != SCM_RIGHTS
+			|| c->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return EXIT_FAILURE;
+
+	memcpy(fds, CMSG_DATA(c), sizeof(fds));
+	dup2(fds[STDIN_FILENO], STDIN_FILENO);
+	dup2(fds[STDERR_FILENO], STDERR_FILENO);
+	close(fds[STDIN_FILENO]);
+	close(fds[STDERR_FILENO]);
+	ks_startpump(&srv->pump, fds[STDOUT_FILENO]);
+
+	if (req.version != SERVE_VERSION || req.argc == 0
+			|| req.len > SERVE_MAXLEN)
+		ks_errx("malformed request");
+
+	buf = ks_stralloc(req.len);
+	if (ks_readfull(sock, buf, req.len) != req.len)
+		ks_errx("truncated request");
+	buf[req.len] = '\0';
+
+	argv = ks_alloc(&m.arena, req.argc * sizeof(*argv));
+	p = buf + strlen(buf) + 1;
+	for (i = 0; i < req.argc; i++) {
+		if (p >= buf + req.len)
+			ks_errx("truncated request");
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+
+	if (chdir(buf) < 0)
+		ks_err("chdir(%s)", buf);
+
+	ks_defaults(&cfg);
+	if (cli_parse((int)req.argc, argv, &cfg) < 0)
+		return EXIT_FAILURE;
+	if (!ks_served(&cfg))
+		ks_errx("command can't be run by a server");
+
+	cfg.database = srv->database;
+	ks_startstats(&cfg);
+	ks_command(&cfg);
+	ks_printstats(1);
+
+	return EXIT_SUCCESS;
+}
+
+/* undo whatever a failed request left behind */
+static void ks_recover(sqlite3 *db)
+{
+	struct stmt *stmt;
+
+	for (stmt = m.stmts; stmt != NULL; stmt = stmt->next)
+		sqlite3_reset(stmt->stmt);
+	ks_closeblob();
+
+	if (m.payload != NULL)
+		ks_closepayload(m.payload);
+	m.payload = NULL;
+	free(m.text);
+	m.text = NULL;
+
+	if (!sqlite3_get_autocommit(db))
+		(void)sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+}
+
+/*
+ * Put the server's own stdio, directory and per-request state back. Returns
+ * nonzero if the client stopped reading the command's output.
+ */
+static int ks_finish(struct server *srv)
+{
+	int stalled;
+	int i;
+
+	fflush(stdout);
+	fflush(stderr);
+	clearerr(stdout);
+	clearerr(stderr);
+
+	dup2(srv->stdio[STDOUT_FILENO], STDOUT_FILENO);
+	stalled = ks_stoppump(&srv->pump);
+	if (stalled)
+		fprintf(stderr, "ks: output not read for %d seconds\n",
+				SERVE_TIMEOUT);
+
+	for (i = 0; i < 3; i++)
+		dup2(srv->stdio[i], i);
+	if (fchdir(srv->cwd) < 0)
+		ks_err("fchdir");
+
+	/* another process's gc may remove packs between requests */
+	ks_closepacks();
+
+	/* names may have been rolled back, or changed by other writers */
+	memset(&m.cids, 0, sizeof(m.cids));
+	memset(&m.tids, 0, sizeof(m.tids));
+	ks_reset(&m.arena);
+
+	/* --stats and --trace were the client's */
+	memset(&st, 0, sizeof(st));
+	ks_settrace(m.db);
+
+	return stalled;
+}
+
+static void ks_stop(int sig)
+{
+	(void)sig;
+	ks_stopping = 1;
+}
+
+static void ks_serve(const struct config *cfg)
+{
+	struct server srv;
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct timeval tv;
+	jmp_buf env;
+	sqlite3 *db;
+	char *database;
+	mode_t mask;
+	int32_t status;
+	int listener;
+	int sock;
+	int i;
+
+	database = ks_alloc(&m.cache, strlen(cfg->database) + 1);
+	srv.database = strcpy(database, cfg->database);
+	srv.pump.running = 0;
+
+	if (ks_sockaddr(&sun, srv.database) < 0)
+		ks_errx("socket path for %s is too long", srv.database);
+
+	db = ks_open(srv.database);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		ks_err("socket");
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+		ks_errx("a server is already running on %s", sun.sun_path);
+	close(sock);
+	if (unlink(sun.sun_path) < 0 && errno != ENOENT)
+		ks_err("unlink(%s)", sun.sun_path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+		ks_err("socket");
+
+	/* only the library's owner may connect */
+	mask = umask(077);
+	if (bind(listener, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		ks_err("bind(%s)", sun.sun_path);
+	umask(mask);
+	if (listen(listener, SOMAXCONN) < 0)
+		ks_err("listen");
+
+	for (i = 0; i < 3; i++) {
+		srv.stdio[i] = dup(i);
+		if (srv.stdio[i] < 0)
+			ks_err("dup");
+	}
+	srv.cwd = open(".", O_RDONLY | O_DIRECTORY);
+	if (srv.cwd < 0)
+		ks_err("open(.)");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = ks_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* a client that stalls sending its request is dropped */
+	tv.tv_sec = SERVE_TIMEOUT;
+	tv.tv_usec = 0;
+
+	while (!ks_stopping) {
+		sock = accept(listener, NULL, NULL);
+		if (sock < 0 && errno == EINTR)
+			continue;
+		else if (sock < 0)
+			ks_err("accept");
+		if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv,
+					sizeof(tv)) < 0)
+			ks_err("setsockopt");
+
+		ks_onerr = &env;
+		if (setjmp(env) == 0) {
+			status = ks_handle(&srv, sock);
+		} else {
+			status = ks_status;
+			ks_recover(db);
+		}
+		ks_onerr = NULL;
+
+		if (ks_finish(&srv))
+			status = EXIT_FAILURE;
+		if (write(sock, &status, sizeof(status)) < 0) {
+			/* the client is gone; there's no one left to tell */
+		}
+		close(sock);
+	}
+
+	close(listener);
+	unlink(sun.sun_path);
+}
+
+static void ks_command(const struct config *cfg)
+{
+	switch (cfg->cmd) {
 	case CMD_ADD:
-		ks_add(&cfg);
+		ks_add(cfg);
 		break;
 	case CMD_CAT:
-		ks_cat(&cfg);
+		ks_cat(cfg);
 		break;
 	case CMD_CATEGORIES:
-		ks_categories(&cfg);
+		ks_categories(cfg);
+		break;
+	case CMD_COMPLETE:
+		ks_complete(cfg);
+		break;
+	case CMD_GC:
+		ks_gc(cfg);
+		break;
+	case CMD_IMPORT:
+		ks_import(cfg);
 		break;
 	case CMD_INIT:
-		ks_init(&cfg);
+		ks_init(cfg);
+		break;
+	case CMD_MIGRATE:
+		ks_migrate(cfg);
 		break;
 	case CMD_MOD:
-		ks_mod(&cfg);
+		ks_mod(cfg);
 		break;
 	case CMD_RM:
-		ks_rm(&cfg);
+		ks_rm(cfg);
+		break;
+	case CMD_SEARCH:
+		ks_search(cfg);
+		break;
+	case CMD_SERVE:
+		ks_serve(cfg);
 		break;
 	case CMD_SHOW:
-		ks_show(&cfg);
+		ks_show(cfg);
 		break;
 	case CMD_TAGS:
-		ks_tags(&cfg);
+		ks_tags(cfg);
 		break;
 	case CMD_VERSION:
-		ks_version(&cfg);
+		ks_version(cfg);
 		break;
 	case CMD_HELP:
 	default:
 		ks_help();
 	}
+}
+
+int main(int argc, const char *argv[])
+{
+	struct config cfg;
+
+	atexit(ks_cleanup);
+
+	ks_defaults(&cfg);
+	if (cli_parse(argc, argv, &cfg) < 0)
+		return EXIT_FAILURE;
+
+	if (ks_served(&cfg))
+		ks_client(&cfg, argc, argv);
+
+	ks_startstats(&cfg);
+	ks_command(&cfg);
+	ks_printstats(0);
 
 	return EXIT_SUCCESS;
 }
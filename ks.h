@@ -7,36 +7,75 @@ enum command {
 	CMD_ADD,
 	CMD_CAT,
 	CMD_CATEGORIES,
+	CMD_COMPLETE,
+	CMD_GC,
 	CMD_HELP,
+	CMD_IMPORT,
 	CMD_INIT,
+	CMD_MIGRATE,
 	CMD_MOD,
 	CMD_RM,
+	CMD_SEARCH,
+	CMD_SERVE,
 	CMD_SHOW,
 	CMD_TAGS,
 	CMD_VERSION,
 };
 
+enum format {
+	FORMAT_TABLE,
+	FORMAT_JSONL,
+	FORMAT_NUL,
+	FORMAT_TSV,
+};
+
 struct tag {
 	struct tag *next;
-	struct tag *mnext;
 	const char *label;
+	int exclude;
+};
+
+struct idrange {
+	struct idrange *next;
+	long long first;
+	long long last;
+};
+
+/* a length of -1 reads to the end; a negative offset counts from the end */
+struct byterange {
+	struct byterange *next;
+	long long offset;
+	long long length;
 };
 
 struct config {
 	const char *category;
 	const char *database;
 	const char *file;
+	const char *query;
 	const char *title;
 	struct tag *tags;
+	struct idrange *ids;
+	struct byterange *ranges;
 	enum command cmd;
-	int id;
+	enum format format;
 	int noheader;
 	int dbversion;
+	int batch;
+	int compress;
+	int jobs;
+	int nul;
+	int framed;
+	int packs;
+	int stats;
+	int trace;
 };
 
-void cli_parse(int argc, const char *argv[], struct config *cfg);
+int cli_parse(int argc, const char *argv[], struct config *cfg);
 
 struct tag *ks_tag();
+struct idrange *ks_idrange();
+struct byterange *ks_byterange();
 
 
 #endif /* end of include guard: KS_H_ */
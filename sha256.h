@@ -0,0 +1,20 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_LEN]);
+
+
+#endif /* end of include guard: SHA256_H_ */
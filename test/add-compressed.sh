@@ -0,0 +1,7 @@
+do_ks init
+yes "a page of a text manual" | head -n 200000 >manual.txt
+do_ks add -t "test" -z 6 -f manual.txt
+do_ks cat 1 | cmp - manual.txt >/dev/null
+[ $? -eq 0 ] || fail "compressed blob not stored correctly"
+[ $(wc -c <ks.db) -lt $(wc -c <manual.txt) ] || fail "blob not compressed"
+rm -f manual.txt
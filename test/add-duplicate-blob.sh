@@ -0,0 +1,6 @@
+do_ks init
+do_ks add -t "first" -f test/blob.txt
+do_ks add -t "second" -f test/blob.txt
+do_ks rm 1
+do_ks cat 2 | grep foobar >/dev/null
+[ $? -eq 0 ] || fail "shared blob removed with first document"
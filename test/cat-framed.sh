@@ -0,0 +1,10 @@
+do_ks init
+printf "first" > cat1.txt
+printf "second\n" > cat2.txt
+do_ks add --title "first" --file cat1.txt
+do_ks add --title "second" --file cat2.txt
+[ "`do_ks cat 1 2`" = "`printf 'firstsecond'`" ] \
+	|| fail "didn't cat documents back to back"
+[ "`do_ks cat --framed 2 1`" = "`printf '2 7\nsecond\n1 5\nfirst'`" ] \
+	|| fail "didn't frame each document"
+rm -f cat1.txt cat2.txt
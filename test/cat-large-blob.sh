@@ -0,0 +1,6 @@
+do_ks init
+head -c 3000000 /dev/urandom >large.bin
+do_ks add -t "test" -f large.bin
+do_ks cat 1 | cmp - large.bin >/dev/null
+[ $? -eq 0 ] || fail "large blob not stored correctly"
+rm -f large.bin
@@ -0,0 +1,12 @@
+do_ks init
+head -c 3000000 /dev/urandom >range.bin
+do_ks add -t "test" -f range.bin
+do_ks cat 1 --offset 1048000 --length 2000 >range.out
+tail -c +1048001 range.bin | head -c 2000 | cmp - range.out >/dev/null
+[ $? -eq 0 ] || fail "didn't read a range across chunks"
+do_ks cat 1 --length 10 --offset -10 >range.out
+(head -c 10 range.bin; tail -c 10 range.bin) | cmp - range.out >/dev/null
+[ $? -eq 0 ] || fail "didn't read several ranges"
+[ `do_ks cat 1 --offset 3000000 | wc -c` -eq 0 ] \
+	|| fail "read past the end of a document"
+rm -f range.bin range.out
@@ -0,0 +1,7 @@
+do_ks init
+do_ks add -t "first" @manuals +rpi4
+do_ks add -t "second" @datasheets +rpi3 +rpi4
+[ "$(do_ks complete | tr '\n' ' ')" = "1 2 @datasheets @manuals +rpi3 +rpi4 " ] \
+	|| fail "incorrect completion listing"
+[ "$(do_ks complete --null | tr '\0' ' ')" = "1 2 @datasheets @manuals +rpi3 +rpi4 " ] \
+	|| fail "incorrect NUL-delimited completion listing"
@@ -0,0 +1,8 @@
+do_ks init
+do_ks add @datasheet -t "test"
+do_ks add @Datasheet -t "test"
+do_ks add @data -t "test"
+num_entries=`do_ks show @data -n | wc -l`
+[ $num_entries -eq 1 ] || fail "category filter did not match exactly"
+num_entries=`do_ks show '@data*' -n | wc -l`
+[ $num_entries -eq 2 ] || fail "couldn't filter by category prefix"
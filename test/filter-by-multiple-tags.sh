@@ -0,0 +1,8 @@
+do_ks init
+do_ks add -t "test" +foo +bar
+do_ks add -t "test" +foo
+do_ks add -t "test" +baz
+num_entries=`do_ks show +foo +bar -n | wc -l`
+[ $num_entries -eq 1 ] || fail "couldn't filter on all tags"
+num_entries=`do_ks show +bar,baz -n | wc -l`
+[ $num_entries -eq 2 ] || fail "couldn't filter on alternative tags"
@@ -0,0 +1,7 @@
+do_ks init
+do_ks add -t "test" +foo +bar
+do_ks add -t "test" +foo
+num_entries=`do_ks show +foo '!bar' -n | wc -l`
+[ $num_entries -eq 1 ] || fail "couldn't exclude tag"
+do_ks show '!bar' -n | grep bar >/dev/null
+[ $? -ne 0 ] || fail "excluded tag was shown"
@@ -0,0 +1,4 @@
+do_ks init
+do_ks add -t "test" +foo +bar
+do_ks show +foo -n | grep bar >/dev/null
+[ $? -eq 0 ] || fail "filtered row is missing its other tags"
@@ -0,0 +1,12 @@
+do_ks init
+yes "gc test data" | head -c 1048576 > gc.txt
+do_ks add --title "kept" @kept +kept
+do_ks add --title "removed" @gone +gone --file gc.txt
+do_ks rm 2
+do_ks gc | grep "purged 0 tag links, 1 tags, 1 categories and 0 blobs" \
+	>/dev/null || fail "gc didn't purge unused rows"
+[ "`do_ks tags`" = "kept" ] || fail "gc removed a tag in use"
+[ "`do_ks categories`" = "kept" ] || fail "gc didn't remove an unused category"
+[ `wc -c < ks.db` -lt 1048576 ] || fail "gc didn't shrink the database"
+do_ks search kept | grep kept >/dev/null || fail "gc broke the search index"
+rm -f gc.txt
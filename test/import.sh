@@ -0,0 +1,14 @@
+do_ks init
+printf 'test/blob.txt\tfirst\tfoo\tbar\tbaz\n\tsecond\n' | do_ks import
+num_entries=`do_ks show -n | wc -l`
+[ $num_entries -eq 2 ] || fail "didn't import every record"
+num_entries=`do_ks show @foo +bar +baz -n | wc -l`
+[ $num_entries -eq 1 ] || fail "didn't import metadata"
+do_ks cat 1 | grep foobar >/dev/null
+[ $? -eq 0 ] || fail "didn't import file"
+yes "a page of a text manual" | head -n 400000 >manual.txt
+printf 'manual.txt\tmanual\n' | do_ks import -z 6
+do_ks cat 3 | cmp - manual.txt >/dev/null
+[ $? -eq 0 ] || fail "compressed import not stored correctly"
+[ $(wc -c <ks.db) -lt $(wc -c <manual.txt) ] || fail "import not compressed"
+rm -f manual.txt
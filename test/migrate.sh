@@ -0,0 +1,28 @@
+do_ks init
+version=`do_ks version -D`
+do_ks migrate
+[ "`do_ks version -D`" = "$version" ] || fail "migrating an up-to-date database changed its version"
+command -v sqlite3 >/dev/null || return 0
+rm -f ks.db
+sqlite3 ks.db <<-SQL || fail "couldn't create a version 0 database"
+	CREATE TABLE categories (cid INTEGER PRIMARY KEY, cname TEXT);
+	CREATE TABLE documents (id INTEGER PRIMARY KEY, title TEXT,
+		cid INTEGER, data BLOB,
+		FOREIGN KEY (cid) REFERENCES categories(cid));
+	CREATE TABLE tags (tid INTEGER PRIMARY KEY, label TEXT);
+	CREATE TABLE doctag (id INTEGER, tid INTEGER,
+		FOREIGN KEY (id) REFERENCES documents(id),
+		FOREIGN KEY (tid) REFERENCES tags(tid));
+	CREATE TABLE version (v INTEGER);
+	INSERT INTO version (v) VALUES (0);
+	INSERT INTO categories (cid, cname) VALUES (1, 'manuals');
+	INSERT INTO documents (id, title, cid, data)
+		VALUES (1, 'old', 1, CAST('an oscilloscope manual' AS BLOB));
+	INSERT INTO tags (tid, label) VALUES (1, 'scope');
+	INSERT INTO doctag (id, tid) VALUES (1, 1);
+SQL
+do_ks migrate
+[ "`do_ks version -D`" = "$version" ] || fail "didn't migrate an old database"
+[ "`do_ks cat 1`" = "an oscilloscope manual" ] || fail "migration lost data"
+do_ks search -n oscilloscope | grep old >/dev/null
+[ $? -eq 0 ] || fail "migration didn't index document text"
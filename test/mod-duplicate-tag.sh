@@ -0,0 +1,5 @@
+do_ks init
+do_ks add -t 'test' +foo
+do_ks mod 1 +foo
+num_tags=`do_ks show -n | grep -o foo | wc -l`
+[ $num_tags -eq 1 ] || fail "duplicate tag added"
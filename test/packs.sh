@@ -0,0 +1,23 @@
+do_ks init --packs
+head -c 3000000 /dev/urandom >pack.bin
+yes "a page of a text manual" | head -n 1000 >pack.txt
+do_ks add -t "binary" -f pack.bin
+do_ks add -t "text" -f pack.txt
+yes "piped" | head -n 1000 | do_ks add -t "piped" -f /dev/stdin
+[ -f ks.db.1.pack ] || fail "data wasn't written to a pack"
+[ $(wc -c <ks.db) -lt 3000000 ] || fail "data was stored in the database"
+do_ks cat 1 | cmp - pack.bin >/dev/null || fail "packed blob read back wrong"
+[ `do_ks cat 3 | grep -c piped` -eq 1000 ] || fail "piped blob read back wrong"
+do_ks cat 1 --offset 1048000 --length 2000 >pack.out
+tail -c +1048001 pack.bin | head -c 2000 | cmp - pack.out >/dev/null
+[ $? -eq 0 ] || fail "didn't read a range of a packed blob"
+do_ks search manual | grep text >/dev/null || fail "packed text not indexed"
+do_ks rm 1
+do_ks gc | grep "compacted 1 packs" >/dev/null || fail "gc didn't compact"
+[ ! -f ks.db.1.pack ] || fail "gc didn't remove the old pack"
+[ $(cat ks.db.*.pack | wc -c) -lt 3000000 ] || fail "gc didn't shrink packs"
+do_ks cat 2 | cmp - pack.txt >/dev/null || fail "compaction lost a blob"
+: >ks.db.99.pack
+do_ks gc >/dev/null
+[ ! -f ks.db.99.pack ] || fail "gc didn't remove a pack no longer used"
+rm -f pack.bin pack.txt pack.out ks.db.*.pack
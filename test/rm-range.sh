@@ -0,0 +1,9 @@
+do_ks init
+for i in 1 2 3 4 5; do
+	do_ks add --title "doc $i" +bulk
+done
+do_ks mod 1 3-4 +retagged
+[ `do_ks show -n +retagged | wc -l` -eq 3 ] || fail "didn't modify every id"
+do_ks rm 2-4 5
+[ "`do_ks show -n --format=tsv`" = "`printf '1\t\tdoc 1\tbulk\tretagged'`" ] \
+	|| fail "didn't remove every id in the range"
@@ -0,0 +1,10 @@
+do_ks init
+do_ks add -t "oscilloscope manual" @manuals
+do_ks add -t "netlist" -f test/blob.txt +schematic
+do_ks add -t "unrelated" @manuals
+do_ks search -n oscilloscope | grep "oscilloscope manual" >/dev/null
+[ $? -eq 0 ] || fail "title not found by search"
+do_ks search -n foobar | grep "netlist" >/dev/null
+[ $? -eq 0 ] || fail "document text not found by search"
+do_ks rm 1
+[ -z "$(do_ks search -n oscilloscope)" ] || fail "removed document still found"
@@ -0,0 +1,34 @@
+do_ks init
+do_ks add -t "first" -f test/blob.txt
+head -c 4000000 /dev/zero >serve.bin
+do_ks add -t "large" -f serve.bin
+KS_JOURNAL_MODE=DELETE ./ks -d ks.db serve &
+server=$!
+while [ ! -S ks.db.sock ]; do sleep 0.1; done
+# only the server, which already has it open, can still find the library
+mv ks.db served.db
+# the socket is bound before the server listens on it
+until ./ks -d ks.db categories >/dev/null 2>&1; do sleep 0.1; done
+served=$(./ks -d ks.db cat 1)
+./ks -d ks.db cat 3 2>/dev/null
+status=$?
+# data from a pipe is read by the client itself, so it can't find the library
+echo piped | ./ks -d ks.db add -t "piped" -f /dev/stdin 2>/dev/null
+piped=$?
+# a client that stops reading its output is dropped
+./ks -d ks.db cat 2 2>/dev/null | sleep 30 &
+stalled=$!
+sleep 1
+start=`date +%s`
+./ks -d ks.db categories >/dev/null
+waited=$((`date +%s` - start))
+kill $stalled
+mv served.db ks.db
+kill $server
+wait $server
+rm -f serve.bin
+echo "$served" | grep foobar >/dev/null || fail "document not read through server"
+[ $status -ne 0 ] || fail "error not reported through server"
+[ $piped -ne 0 ] || fail "piped data sent to the server"
+[ $waited -lt 15 ] || fail "a stalled client held up the server"
+[ ! -e ks.db.sock ] || fail "server socket not removed"
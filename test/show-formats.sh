@@ -0,0 +1,11 @@
+do_ks init
+do_ks add -t "first doc" @manuals +rpi4
+[ "$(do_ks show --format=tsv -n)" = "$(printf '1\tmanuals\tfirst doc\trpi4')" ] \
+	|| fail "incorrect TSV output"
+do_ks show --format=jsonl | grep -F '"title":"first doc"' >/dev/null
+[ $? -eq 0 ] || fail "incorrect JSON Lines output"
+[ "$(do_ks show --format=nul | tr '\0' '\n')" = "$(printf '1\tmanuals\tfirst doc\trpi4')" ] \
+	|| fail "incorrect NUL-delimited output"
+do_ks add -t "$(printf 'tab\tbed')"
+[ "$(do_ks show --format=nul 2 | tr '\0' '\n')" = "$(printf '2\t\ttab\\tbed')" ] \
+	|| fail "NUL-delimited output not escaped"
@@ -0,0 +1,6 @@
+do_ks init
+do_ks add --title "foobar"
+do_ks --stats show 2>&1 >/dev/null | grep "stats: total" >/dev/null \
+	|| fail "didn't print stats"
+do_ks --trace show 2>&1 >/dev/null | grep "trace: .* FROM documents" \
+	>/dev/null || fail "didn't trace statements"